@@ -8,21 +8,67 @@ engine.logging = {
 // connection.
 engine.debugProtocol = true;
 
-// Load the "sql" module. Registers the global "sql" object, which has
-// the getConnection(url) method.
-engine.loadModule("mod_sql.so");
+// Maximum message size in bytes, advertised through the SIZE extension
+// (RFC 1870). Larger messages are rejected before or during DATA. Set
+// to 0 (or leave undefined) to disable the limit.
+engine.maxMessageSize = 10 * 1024 * 1024;
+
+// JavaScript heap settings. maxBytes limits the GC heap and
+// maxMallocBytes the memory allocated outside of it before a collection
+// is forced; triggerFactor is the heap growth (in percent) that triggers
+// a collection. With betweenTransactions, garbage is collected at the
+// end of every transaction instead of in the middle of a command.
+engine.gc = {
+	maxBytes: 8 * 1024 * 1024,
+	betweenTransactions: true
+};
 
-// Load the mysql driver module. This enables using URLs that start
-// with "mysql://" with the sql.getConnection() method.
-engine.loadModule("mod_mysql.so");
+// CPU time budget (in milliseconds) of every smtpServer handler. A
+// handler that exceeds it is aborted and the client gets the response
+// below instead. Set timeout to 0 to disable the watchdog.
+engine.watchdog = {
+	timeout: 5000,
+	code: 451,
+	message: "Local error in processing"
+};
 
-// Load the SMTP client module. This module allows connecting to other
-// SMTP servers as a client.
-engine.loadModule("mod_smtp_client.so");
+// Size of the key/value cache that all the sessions share. Scripts use it
+// through the global "cache" object, e.g. cache.incr("conn:" + address,
+// 1, 60) to count connections per minute. The cache is created when the
+// server starts, so it is empty (and ignores updates) while this script
+// runs.
+engine.cache = {
+	entries: 16384
+};
 
+// Native modules are shared objects; a name without a slash is looked up
+// in the module directory (the package lib directory by default). A module
+// that is not installed is skipped with a warning and loadModule() returns
+// false; one that cannot be loaded, or was built for another mailfilter
+// version, aborts the configuration script.
+
+// The "proxy" module relays MAIL, RCPT and DATA to the SMTP server on
+// 127.0.0.1, port 25, once smtpServer.rules or the smtpXxxx handlers have
+// accepted them, and answers the client with its responses. Envelope
+// commands are pipelined when the server supports it.
+//engine.loadModule("mod_proxy.so");
 
 smtpServer.listenAddress = [["127.0.0.1", "8025"]];
 
+// Static policy, decided natively before the smtpXxxx handlers. The rules
+// of a command are tried in order and the first one whose conditions
+// (domain, client) all match either replies with its code and message or
+// relays the command to the server that smtpClient is connected to. The
+// handler only runs if no rule matches. A domain that starts with a dot
+// matches all its subdomains.
+smtpServer.rules = [
+	{ command: "RCPT", domain: ["example.com", ".example.com"], action: "relay" },
+	{ command: "RCPT", client: "127.0.0.0/8", action: "relay" },
+	{ command: "RCPT", code: 550, message: "Relaying denied" },
+	{ command: "MAIL", action: "relay" },
+	{ command: "RSET", action: "relay" }
+];
+
 // Provide the initial SMTP greeting that the server will send to the
 // client, as an SmtpStatus object.
 smtpServer.initialGreeting = function () {
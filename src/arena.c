@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "arena.h"
+
+/* Free chunks, shared by all arenas in the process */
+static struct arena_chunk *arena_pool = NULL;
+static int arena_pool_size = 0;
+
+/* Memory used by all chunks in the process, pooled ones included */
+static size_t arena_mem = 0;
+
+static struct arena_chunk *arena_chunk_alloc(size_t size)
+{
+	struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+
+	if (chunk != NULL)
+		arena_mem += sizeof(struct arena_chunk) + size;
+
+	return chunk;
+}
+
+static void arena_chunk_free(struct arena_chunk *chunk)
+{
+	arena_mem -= sizeof(struct arena_chunk) + chunk->size;
+	free(chunk);
+}
+
+/*
+ * Slow path of arena_alloc(): the current chunk is full. Large blocks get
+ * a chunk of their own, which is linked after the current chunk so that
+ * the free space in the current chunk is not wasted.
+ */
+void *__arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	if (size > ARENA_CHUNK_SIZE / 4) {
+		if ((chunk = arena_chunk_alloc(size)) == NULL)
+			return NULL;
+		chunk->size = chunk->used = size;
+		if (arena->chunks == NULL) {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		} else {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		return chunk->data;
+	}
+
+	if (arena_pool != NULL) {
+		chunk = arena_pool;
+		arena_pool = chunk->next;
+		arena_pool_size--;
+	} else if ((chunk = arena_chunk_alloc(ARENA_CHUNK_SIZE)) == NULL)
+		return NULL;
+
+	chunk->size = ARENA_CHUNK_SIZE;
+	chunk->used = size;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	return chunk->data;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t n)
+{
+	char *p = arena_alloc(arena, n + 1);
+
+	if (p == NULL)
+		return NULL;
+
+	memcpy(p, s, n);
+	p[n] = '\0';
+
+	return p;
+}
+
+char *arena_printf(struct arena *arena, const char *format, ...)
+{
+	va_list ap;
+	char *p;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	if (n < 0 || (p = arena_alloc(arena, n + 1)) == NULL)
+		return NULL;
+
+	va_start(ap, format);
+	vsnprintf(p, n + 1, format, ap);
+	va_end(ap);
+
+	return p;
+}
+
+/*
+ * Release everything that was allocated from the arena. Regular chunks
+ * go back to the pool (up to ARENA_POOL_MAX), large ones are freed.
+ */
+void arena_reset(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		if (chunk->size != ARENA_CHUNK_SIZE || arena_pool_size >= ARENA_POOL_MAX) {
+			arena_chunk_free(chunk);
+			continue;
+		}
+		chunk->next = arena_pool;
+		arena_pool = chunk;
+		arena_pool_size++;
+	}
+}
+
+/*
+ * Give the pooled chunks back to the system, e.g. while the session is
+ * idle.
+ */
+void arena_trim(void)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena_pool) != NULL) {
+		arena_pool = chunk->next;
+		arena_chunk_free(chunk);
+	}
+	arena_pool_size = 0;
+}
+
+/*
+ * Number of bytes currently held by arenas and by the pool
+ */
+size_t arena_footprint(void)
+{
+	return arena_mem;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+/* Bump allocator for data that lives as long as an SMTP transaction.
+ * Nothing is freed individually: arena_reset() releases everything at
+ * once and keeps the chunks for reuse. */
+
+#include <stddef.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE 16384
+
+/* Maximum number of free chunks kept for reuse by the process */
+#define ARENA_POOL_MAX 16
+
+#define ARENA_ALIGN sizeof(void *)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+struct arena {
+	/* Chunk list; allocations are served from the first chunk */
+	struct arena_chunk *chunks;
+};
+
+#define ARENA_INITIALIZER { .chunks = NULL }
+
+static inline void arena_init(struct arena *arena)
+{
+	arena->chunks = NULL;
+}
+
+void *__arena_alloc(struct arena *arena, size_t size);
+
+static inline void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->size - chunk->used < size)
+		return __arena_alloc(arena, size);
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t n);
+
+static inline char *arena_strdup(struct arena *arena, const char *s)
+{
+	return arena_strndup(arena, s, strlen(s));
+}
+
+char *arena_printf(struct arena *arena, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void arena_reset(struct arena *arena);
+void arena_trim(void);
+size_t arena_footprint(void);
+
+#endif
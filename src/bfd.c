@@ -29,6 +29,29 @@
 
 #include "bfd.h"
 
+/* Memory used by all streams in the process */
+static size_t bfd_mem = 0;
+
+static char *bfd_buf_alloc(void)
+{
+	char *buf = malloc(BFD_SIZE);
+
+	if (buf != NULL)
+		bfd_mem += BFD_SIZE;
+
+	return buf;
+}
+
+static void bfd_buf_free(char **buf)
+{
+	if (*buf == NULL)
+		return;
+
+	free(*buf);
+	*buf = NULL;
+	bfd_mem -= BFD_SIZE;
+}
+
 bfd_t *bfd_alloc(int fd)
 {
 	bfd_t *ret = malloc(sizeof(bfd_t));
@@ -37,9 +60,12 @@ bfd_t *bfd_alloc(int fd)
 		return ret;
 
 	ret->fd = fd;
+	ret->rb = NULL;
 	ret->rh = 0;
 	ret->rt = 0;
+	ret->wb = NULL;
 	ret->wi = 0;
+	bfd_mem += sizeof(bfd_t);
 
 	return ret;
 }
@@ -52,10 +78,36 @@ int bfd_close(bfd_t *bfd)
 	if (close(bfd->fd) < 0)
 		return -1;
 
+	bfd_buf_free(&bfd->rb);
+	bfd_buf_free(&bfd->wb);
+	bfd_mem -= sizeof(bfd_t);
 	free(bfd);
 	return 0;
 }
 
+/*
+ * Release the buffers that hold no data. They are allocated again when
+ * the stream is used.
+ */
+void bfd_shrink(bfd_t *bfd)
+{
+	if (bfd->rh >= bfd->rt) {
+		bfd_buf_free(&bfd->rb);
+		bfd->rh = bfd->rt = 0;
+	}
+
+	if (!bfd->wi)
+		bfd_buf_free(&bfd->wb);
+}
+
+/*
+ * Number of bytes currently used by streams and their buffers
+ */
+size_t bfd_footprint(void)
+{
+	return bfd_mem;
+}
+
 int bfd_flush(bfd_t *bfd)
 {
 	ssize_t sz;
@@ -85,6 +137,11 @@ ssize_t bfd_write(bfd_t *bfd, const char *p, size_t len)
 	if (!len)
 		return 0;
 
+	if (bfd->wb == NULL && (bfd->wb = bfd_buf_alloc()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
 	if (bfd->wi >= BFD_SIZE) {
 		sz = write(bfd->fd, bfd->wb, BFD_SIZE);
 		if (sz <= 0)
@@ -115,6 +172,32 @@ int bfd_write_full(bfd_t *bfd, const char *p, size_t len)
 	return 0;
 }
 
+/*
+ * Make sure the read buffer is not empty, so that the data can be parsed
+ * in place (at bfd->rb + bfd->rh). Returns the number of buffered bytes,
+ * 0 on EOF or negative on error.
+ */
+ssize_t bfd_fill(bfd_t *bfd)
+{
+	ssize_t sz;
+
+	if (bfd->rh < bfd->rt)
+		return bfd->rt - bfd->rh;
+
+	if (bfd->rb == NULL && (bfd->rb = bfd_buf_alloc()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	sz = read(bfd->fd, bfd->rb, BFD_SIZE);
+	if (sz <= 0)
+		return sz;
+	bfd->rh = 0;
+	bfd->rt = sz;
+
+	return sz;
+}
+
 ssize_t bfd_read(bfd_t *bfd, char *p, size_t len)
 {
 	ssize_t sz;
@@ -122,13 +205,8 @@ ssize_t bfd_read(bfd_t *bfd, char *p, size_t len)
 	if (!len)
 		return 0;
 
-	if (bfd->rh >= bfd->rt) {
-		sz = read(bfd->fd, bfd->rb, BFD_SIZE);
-		if (sz <= 0)
-			return sz;
-		bfd->rh = 0;
-		bfd->rt = sz;
-	}
+	if ((sz = bfd_fill(bfd)) <= 0)
+		return sz;
 
 	sz = bfd->rt - bfd->rh < len ? bfd->rt - bfd->rh : len;
 	memcpy(p, &bfd->rb[bfd->rh], sz);
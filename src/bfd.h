@@ -26,11 +26,16 @@
 
 #define BFD_SIZE 4096
 
+/*
+ * The buffers are allocated on first use and can be released again with
+ * bfd_shrink() while they are empty, so that an idle stream only costs
+ * the struct itself.
+ */
 struct bfd {
 	int fd;
-	char rb[BFD_SIZE];			/* read buffer */
+	char *rb;					/* read buffer */
 	size_t rh, rt;				/* read head, read tail */
-	char wb[BFD_SIZE];			/* write buffer */
+	char *wb;					/* write buffer */
 	size_t wi;					/* write index */
 };
 
@@ -41,10 +46,13 @@ extern int bfd_close(bfd_t *bfd);
 extern int bfd_flush(bfd_t *bfd);
 extern ssize_t bfd_write(bfd_t *bfd, const char *p, size_t len);
 extern int bfd_write_full(bfd_t *bfd, const char *p, size_t len);
+extern ssize_t bfd_fill(bfd_t *bfd);
 extern ssize_t bfd_read(bfd_t *bfd, char *p, size_t len);
 extern int bfd_printf(bfd_t *bfd, const char *format, ...);
 extern ssize_t bfd_read_line(bfd_t *bfd, char *buf, size_t len);
 extern int bfd_copy(bfd_t *src, bfd_t *dst);
+extern void bfd_shrink(bfd_t *bfd);
+extern size_t bfd_footprint(void);
 
 static inline int bfd_puts(bfd_t *bfd, const char *s)
 {
@@ -53,6 +61,15 @@ static inline int bfd_puts(bfd_t *bfd, const char *s)
 
 extern off_t bfd_seek(bfd_t *bfd, off_t offset, int whence);
 
+/*
+ * Check if a complete line is already in the read buffer, which means
+ * that the next bfd_read_line() will not block.
+ */
+static inline int bfd_line_buffered(bfd_t *bfd)
+{
+	return bfd->rh < bfd->rt && memchr(&bfd->rb[bfd->rh], '\n', bfd->rt - bfd->rh) != NULL;
+}
+
 static inline int bfd_getc(bfd_t *bfd)
 {
 	unsigned char c;
@@ -35,12 +35,22 @@
 /* Main server configuration */
 struct config config = {
 	.path = "/etc/mailfilter.js",
+	.script_cache = NULL,
 	.daemon = 1,
 	.smtp_debug = 0,
 	.logging_type = LOGGING_TYPE_STDERR,
 	.logging_level = LOG_INFO,
 	.logging_facility = LOG_DAEMON,
 	.dbconn = NULL,
+	.smtp_max_size = 0,
+	.js_max_bytes = 8 * 1024 * 1024,
+	.js_max_malloc_bytes = 0,
+	.js_gc_trigger_factor = 0,
+	.js_gc_transaction = 1,
+	.js_handler_timeout = 5000,
+	.js_timeout_code = 451,
+	.js_timeout_message = "Local error in processing",
+	.cache_entries = 16384,
 };
 
 const struct str2val_map log_types[] = {
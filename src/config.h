@@ -27,6 +27,8 @@
 struct config {
 	/* Global configuration parameters (not included in config file) */
 	const char *path;
+	/* Compiled configuration cache; NULL means <path>.xdr */
+	const char *script_cache;
 	int daemon;
 	int smtp_debug;
 
@@ -41,6 +43,29 @@ struct config {
 	const char *logging_path;
 	const char *dbconn;
 
+	/* Maximum message size (RFC 1870); 0 means no limit */
+	unsigned long smtp_max_size;
+
+	/* JavaScript heap (engine.gc); 0 means the engine default */
+	unsigned long js_max_bytes;
+	unsigned long js_max_malloc_bytes;
+	unsigned long js_gc_trigger_factor;
+
+	/* Collect garbage between SMTP transactions, rather than when the
+	 * heap fills up in the middle of a command */
+	int js_gc_transaction;
+
+	/* CPU time budget of a command handler, in milliseconds; 0 means
+	 * no limit. Handlers that exceed it are aborted, and the client
+	 * gets the response below. */
+	unsigned long js_handler_timeout;
+	unsigned long js_timeout_code;
+	const char *js_timeout_message;
+
+	/* Number of entries of the cache shared by the workers; 0
+	 * disables it */
+	unsigned long cache_entries;
+
 	const char *listen_address;
 	int listen_port;
 };
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 
@@ -31,9 +32,9 @@
 
 static const char *tab_space = "\t ";
 
-struct im_header *im_header_alloc(const char *name)
+struct im_header *im_header_alloc(struct arena *arena, const char *name)
 {
-	struct im_header *hdr = malloc(sizeof(struct im_header));
+	struct im_header *hdr = arena_alloc(arena, sizeof(struct im_header));
 
 	if (hdr == NULL)
 		return NULL;
@@ -41,43 +42,133 @@ struct im_header *im_header_alloc(const char *name)
 	if (name == NULL)
 		hdr->name = NULL;
 	else
-		if ((hdr->name = strdup(name)) == NULL) {
-			free(hdr);
+		if ((hdr->name = arena_strdup(arena, name)) == NULL)
 			return NULL;
-		}
 
+	hdr->arena = arena;
 	hdr->value = NULL;
+	hdr->raw = NULL;
+	hdr->raw_off = 0;
+	hdr->raw_len = 0;
+	hdr->hash = name != NULL ? im_header_hash(name) : 0;
+	INIT_LIST_HEAD(&hdr->hash_lh);
+	hdr->index = -1;
 	INIT_LIST_HEAD(&hdr->folding);
 	return hdr;
 }
 
+/* ====================== header index functions ====================== */
+
+/*
+ * Case insensitive FNV-1a hash of a header name
+ */
+unsigned int im_header_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name != '\0'; name++) {
+		hash ^= tolower((unsigned char)*name);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+void im_header_hash_init(struct list_head *hash)
+{
+	int i;
+
+	for (i = 0; i < IM_HEADER_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&hash[i]);
+}
+
+/*
+ * Insert a header into the header list hdrs, before pos, and into the
+ * hash index (unless hash is NULL). To keep the bucket in message order,
+ * the header is linked before the next header in the same bucket; when
+ * appending (pos == hdrs), this is always the bucket tail.
+ */
+void im_header_insert(struct list_head *hdrs, struct list_head *hash, struct im_header *hdr, struct list_head *pos)
+{
+	unsigned int bucket = hdr->hash % IM_HEADER_HASH_SIZE;
+	struct im_header *next;
+	struct list_head *lh;
+
+	list_add_tail(&hdr->lh, pos);
+
+	if (hash == NULL)
+		return;
+
+	for (lh = pos; lh != hdrs; lh = lh->next) {
+		next = list_entry(lh, struct im_header, lh);
+		if (next->hash % IM_HEADER_HASH_SIZE == bucket) {
+			list_add_tail(&hdr->hash_lh, &next->hash_lh);
+			return;
+		}
+	}
+
+	list_add_tail(&hdr->hash_lh, &hash[bucket]);
+}
+
+/*
+ * Remove a header from its list and from the hash index. The header is
+ * not freed.
+ */
+void im_header_remove(struct im_header *hdr)
+{
+	list_del(&hdr->lh);
+	list_del_init(&hdr->hash_lh);
+}
+
+/*
+ * Find the first header with the given name (case insensitive)
+ */
 struct im_header *im_header_find(struct smtp_server_context *ctx, const char *name)
 {
+	unsigned int hash = im_header_hash(name);
 	struct im_header *hdr;
 
-	list_for_each_entry(hdr, &ctx->hdrs, lh) {
-		if (!strcasecmp(hdr->name, name))
+	if (ctx->hdrs_hash == NULL)
+		return NULL;
+
+	list_for_each_entry(hdr, &ctx->hdrs_hash[hash % IM_HEADER_HASH_SIZE], hash_lh) {
+		if (hdr->hash == hash && !strcasecmp(hdr->name, name))
 			return hdr;
 	}
 
 	return NULL;
 }
 
+/*
+ * Find the next header with the same name as hdr, in message order
+ */
+struct im_header *im_header_find_next(struct smtp_server_context *ctx, struct im_header *hdr)
+{
+	struct list_head *bucket = &ctx->hdrs_hash[hdr->hash % IM_HEADER_HASH_SIZE];
+	struct im_header *next;
+	struct list_head *lh;
+
+	for (lh = hdr->hash_lh.next; lh != bucket; lh = lh->next) {
+		next = list_entry(lh, struct im_header, hash_lh);
+		if (next->hash == hdr->hash && !strcasecmp(next->name, hdr->name))
+			return next;
+	}
+
+	return NULL;
+}
+
 void im_header_unfold(struct im_header *hdr)
 {
-	struct im_header_folding *fold, *tmp;
+	/* the header is modified, so the original bytes are no longer valid */
+	hdr->raw = NULL;
 
-	list_for_each_entry_safe(fold, tmp, &hdr->folding, lh) {
-		list_del(&fold->lh);
-		if (fold->original)
-			free(fold->original);
-		free(fold);
-	}
+	/* the foldings belong to the arena, so we just drop them */
+	INIT_LIST_HEAD(&hdr->folding);
 }
 
 struct im_header_folding *im_header_add_fold(struct im_header *hdr, size_t offset)
 {
-	struct im_header_folding *fold = malloc(sizeof(struct im_header_folding));
+	struct im_header_folding *fold = arena_alloc(hdr->arena, sizeof(struct im_header_folding));
 
 	if (fold == NULL)
 		return NULL;
@@ -123,10 +214,13 @@ int im_header_refold(struct im_header *hdr, int width)
  */
 static int im_header_alloc_ctx(struct im_header_context *ctx)
 {
-	ctx->header = new_header_instance(ctx->sb.s);
+	if ((ctx->hdr = im_header_alloc(ctx->arena, ctx->sb.s)) == NULL)
+		return 1;
+	ctx->hdr->raw_off = ctx->raw_off;
+	im_header_insert(ctx->hdrs, ctx->hdrs_hash, ctx->hdr, ctx->hdrs);
 	string_buffer_reset(&ctx->sb);
 
-	return JSVAL_IS_NULL(ctx->header) ? 1 : 0;
+	return 0;
 }
 
 
@@ -136,11 +230,20 @@ static int im_header_alloc_ctx(struct im_header_context *ctx)
  */
 static int im_header_set_value_ctx(struct im_header_context *ctx)
 {
-	int ret = add_part_to_header(&ctx->header, ctx->sb.s);
-	add_new_header(&ctx->header);
-	ctx->header = JSVAL_NULL;
+	if (ctx->sb.s != NULL && string_buffer_append_string(&ctx->value, ctx->sb.s))
+		return 1;
+	ctx->hdr->value = arena_strndup(ctx->arena, ctx->value.s ? ctx->value.s : "", ctx->value.cur);
+	if (ctx->hdr->value == NULL)
+		return 1;
+	string_buffer_reset(&ctx->value);
+
+	/* the last character in the raw block already belongs to the next
+	 * line, so it is not part of this header */
+	ctx->hdr->raw_len = ctx->raw.cur - 1 - ctx->hdr->raw_off;
+	ctx->hdr = NULL;
+
 	string_buffer_reset(&ctx->sb);
-	return ret;
+	return 0;
 }
 
 /*
@@ -149,20 +252,63 @@ static int im_header_set_value_ctx(struct im_header_context *ctx)
  */
 static int im_header_add_fold_ctx(struct im_header_context *ctx)
 {
-	add_part_to_header(&ctx->header, ctx->sb.s);
+	if (ctx->sb.s != NULL && string_buffer_append_string(&ctx->value, ctx->sb.s))
+		return 1;
+	if (im_header_add_fold(ctx->hdr, ctx->value.cur) == NULL)
+		return 1;
+
 	string_buffer_reset(&ctx->sb);
 	return 0;
 }
 
+/*
+ * Strip the empty line that ends the header block from the raw block and
+ * point the parsed headers to their original bytes.
+ */
+static int im_header_finish_ctx(struct im_header_context *ctx, size_t eol)
+{
+	struct im_header *hdr;
+
+	ctx->raw.cur -= eol;
+	ctx->raw.s[ctx->raw.cur] = '\0';
+
+	/* the headers outlive the parser, so move the block out of it */
+	if ((ctx->raw_block = string_buffer_detach(&ctx->raw)) == NULL)
+		return IM_OUT_OF_MEM;
+
+	list_for_each_entry(hdr, ctx->hdrs, lh)
+		if (hdr->raw_len)
+			hdr->raw = ctx->raw_block + hdr->raw_off;
+
+	return IM_COMPLETE;
+}
+
+/*
+ * Free the parser buffers. The complete raw header block
+ * (ctx->raw_block) is left alone, because the parsed headers point into
+ * it; the caller owns it.
+ */
+void im_header_context_cleanup(struct im_header_context *ctx)
+{
+	string_buffer_cleanup(&ctx->sb);
+	string_buffer_cleanup(&ctx->value);
+	string_buffer_cleanup(&ctx->raw);
+}
+
 /*
  * Feed a single character to the header parsing state machine.
  */
 int im_header_feed(struct im_header_context *ctx, char c)
 {
+	/* keep the original bytes, so that the headers can be relayed
+	 * verbatim if they are not modified */
+	if (string_buffer_append_char(&ctx->raw, c))
+		return IM_OUT_OF_MEM;
+
 	switch (ctx->state) {
 	case IM_H_NAME1:
 		if (strchr(tab_space, c)) {
-			if (JSVAL_IS_NULL(ctx->header))
+			if (ctx->hdr == NULL)
 				return IM_PARSE_ERROR;
 			if (im_header_add_fold_ctx(ctx))
 				return IM_OUT_OF_MEM;
@@ -173,18 +319,19 @@ int im_header_feed(struct im_header_context *ctx, char c)
 			ctx->state = IM_H_FOLD;
 			return IM_OK;
 		}
-		if (!JSVAL_IS_NULL(ctx->header) && im_header_set_value_ctx(ctx)) {
+		if (ctx->hdr != NULL && im_header_set_value_ctx(ctx)) {
 			return IM_OUT_OF_MEM;
 		}
 
 		if (c == '\n') {
-			return IM_COMPLETE;
+			return im_header_finish_ctx(ctx, 1);
 		}
 		if (c == '\r') {
 			ctx->state = IM_H_FIN;
-			printf("fin=%s\n", ctx->sb.s);
 			return IM_OK;
 		}
+		/* A new header starts here */
+		ctx->raw_off = ctx->raw.cur - 1;
 		/* Intentionally fall back to IM_H_NAME2 */
 	case IM_H_NAME2:
 		if (c == ':') {
@@ -234,12 +381,75 @@ int im_header_feed(struct im_header_context *ctx, char c)
 	case IM_H_FIN:
 		if (c != '\n')
 			return IM_PARSE_ERROR;
-		return IM_COMPLETE;
+		return im_header_finish_ctx(ctx, 2);
 	}
 
 	return IM_WTF;
 }
 
+/*
+ * Append a run of characters that do not change the parser state to the
+ * current token (and to the raw block).
+ */
+static int im_header_append_run(struct im_header_context *ctx, const char *p, size_t len)
+{
+	if (ctx->curr_size + len > ctx->max_size)
+		return IM_OVERRUN;
+	ctx->curr_size += len;
+
+	if (string_buffer_append_strn(&ctx->raw, p, len))
+		return IM_OUT_OF_MEM;
+	if (string_buffer_append_strn(&ctx->sb, p, len))
+		return IM_OUT_OF_MEM;
+
+	return IM_OK;
+}
+
+/*
+ * Feed a buffer to the header parsing state machine. Header names and
+ * values are located with memchr() and copied at once; only the bytes
+ * that change the state go through im_header_feed().
+ *
+ * Returns the same codes as im_header_feed(). The number of bytes that
+ * were consumed is stored in *used; after IM_COMPLETE, the rest of the
+ * buffer belongs to the message body.
+ */
+int im_header_feed_buf(struct im_header_context *ctx, const char *buf, size_t len, size_t *used)
+{
+	const char *p = buf, *end = buf + len, *q, *cr;
+	int ret = IM_OK;
+
+	while (p < end) {
+		switch (ctx->state) {
+		case IM_H_NAME2:
+			if ((q = memchr(p, ':', end - p)) == NULL)
+				q = end;
+			break;
+		case IM_H_VAL2:
+			if ((q = memchr(p, '\n', end - p)) == NULL)
+				q = end;
+			if ((cr = memchr(p, '\r', q - p)) != NULL)
+				q = cr;
+			break;
+		default:
+			q = p;
+		}
+
+		if (q > p) {
+			if ((ret = im_header_append_run(ctx, p, q - p)) != IM_OK)
+				break;
+			p = q;
+			continue;
+		}
+
+		if ((ret = im_header_feed(ctx, *(p++))) != IM_OK)
+			break;
+	}
+
+	*used = p - buf;
+	return ret;
+}
+
 int __im_header_write(struct im_header *hdr, bfd_t *f)
 {
 	char *s = hdr->value;
@@ -264,8 +474,9 @@ int __im_header_write(struct im_header *hdr, bfd_t *f)
 		prev_offset = offset;
 		if (bfd_puts(f, "\r\n\t") < 0)
 			return 1;
-		/* FIXME replace \r\n\t sequence with folding->original when
-		 * it is implemented by im_header_feed() */
+		/* Headers that were received from the client and are not
+		 * modified are written from hdr->raw, with the original
+		 * folding, so this only applies to generated headers. */
 	}
 
 	if (bfd_puts(f, s) < 0)
@@ -277,15 +488,39 @@ int __im_header_write(struct im_header *hdr, bfd_t *f)
 int im_header_write(struct list_head *lh, bfd_t *f)
 {
 	struct im_header *hdr;
+	const char *raw = NULL;
+	size_t len = 0;
 	int err;
 
 	list_for_each_entry(hdr, lh, lh) {
+		/* Unmodified headers are replayed verbatim; adjacent ones
+		 * are still contiguous in the raw block, so they are sent
+		 * as a single slice. */
+		if (hdr->raw != NULL) {
+			if (raw != NULL && raw + len == hdr->raw) {
+				len += hdr->raw_len;
+				continue;
+			}
+			if (raw != NULL && bfd_write_full(f, raw, len) < 0)
+				return 1;
+			raw = hdr->raw;
+			len = hdr->raw_len;
+			continue;
+		}
+
+		if (raw != NULL && bfd_write_full(f, raw, len) < 0)
+			return 1;
+		raw = NULL;
+
 		if ((err = __im_header_write(hdr, f)))
 			return err;
 		if (bfd_puts(f, "\r\n") < 0)
 			return 1;
 	}
 
+	if (raw != NULL && bfd_write_full(f, raw, len) < 0)
+		return 1;
+
 	return 0;
 }
 
@@ -300,17 +535,3 @@ void im_header_dump(struct list_head *lh)
 		n++;
 	}
 }
-
-void im_header_free(struct im_header *hdr)
-{
-	struct im_header_folding *folding, *folding_aux;
-
-	if (hdr->name != NULL)
-		free(hdr->name);
-	if (hdr->value != NULL)
-		free(hdr->value);
-	list_for_each_entry_safe(folding, folding_aux, &hdr->folding, lh) {
-		free(folding);
-	}
-	free(hdr);
-}
@@ -27,18 +27,35 @@
 #include "list.h"
 #include "string_tools.h"
 #include "bfd.h"
-#include <jsapi.h>
+#include "arena.h"
 
 struct smtp_server_context;
 
+/* Number of buckets in the header name hash index */
+#define IM_HEADER_HASH_SIZE 32
+
 /**
  * A single header: name-value pair.
  */
 struct im_header {
 	struct list_head lh;
+	/* Arena that the header, its name, value and foldings belong to */
+	struct arena *arena;
 	char *name;
 	char *value;
 	struct list_head folding;
+	/* Original bytes of the header (including the line terminator), as
+	 * received from the client. NULL for inserted or modified headers,
+	 * which are serialized from name and value. */
+	const char *raw;
+	size_t raw_off, raw_len;
+	/* Hash of the (case insensitive) name and link in the hash index;
+	 * headers in the same bucket are kept in message order */
+	unsigned int hash;
+	struct list_head hash_lh;
+	/* Position in the JS Headers view, set when the view is indexed;
+	 * -1 until then */
+	int index;
 };
 
 /**
@@ -63,19 +80,37 @@ struct im_header_context {
 		IM_H_FOLD,
 		IM_H_FIN
 	} state;
-	jsval header;
+	/* Header currently being parsed */
+	struct im_header *hdr;
 	struct list_head *hdrs;
+	/* Hash index of hdrs (IM_HEADER_HASH_SIZE buckets) or NULL */
+	struct list_head *hdrs_hash;
+	/* Parsed headers are allocated from here */
+	struct arena *arena;
 	size_t max_size, curr_size;
 	struct string_buffer sb;
+	/* Unfolded value of the current header */
+	struct string_buffer value;
+	/* Raw header block and offset of the current header within it */
+	struct string_buffer raw;
+	size_t raw_off;
+	/* Raw header block, detached from raw once the block is complete */
+	char *raw_block;
 };
 
 #define IM_HEADER_CONTEXT_INITIALIZER {\
 	.state = IM_H_NAME1,\
-	.header = JSVAL_NULL,\
+	.hdr = NULL,\
 	.hdrs = NULL,\
+	.hdrs_hash = NULL,\
+	.arena = NULL,\
 	.max_size = 0,\
 	.curr_size = 0,\
-	.sb = STRING_BUFFER_INITIALIZER\
+	.sb = STRING_BUFFER_INITIALIZER,\
+	.value = STRING_BUFFER_INITIALIZER,\
+	.raw = STRING_BUFFER_INITIALIZER,\
+	.raw_off = 0,\
+	.raw_block = NULL\
 }
 
 enum {
@@ -87,13 +122,24 @@ enum {
 	IM_WTF
 };
 
-struct im_header *im_header_alloc(const char *name);
+struct im_header *im_header_alloc(struct arena *arena, const char *name);
+unsigned int im_header_hash(const char *name);
+void im_header_hash_init(struct list_head *hash);
+void im_header_insert(struct list_head *hdrs, struct list_head *hash, struct im_header *hdr, struct list_head *pos);
+void im_header_remove(struct im_header *hdr);
 struct im_header *im_header_find(struct smtp_server_context *ctx, const char *name);
+struct im_header *im_header_find_next(struct smtp_server_context *ctx, struct im_header *hdr);
+
+/* Iterate over all headers with the given name, in message order */
+#define im_header_for_each(hdr, ctx, name) \
+	for (hdr = im_header_find(ctx, name); hdr != NULL; hdr = im_header_find_next(ctx, hdr))
 int im_header_feed(struct im_header_context *ctx, char c);
+int im_header_feed_buf(struct im_header_context *ctx, const char *buf, size_t len, size_t *used);
+void im_header_context_cleanup(struct im_header_context *ctx);
 void im_header_dump(struct list_head *lh);
 void im_header_unfold(struct im_header *hdr);
+struct im_header_folding *im_header_add_fold(struct im_header *hdr, size_t offset);
 int im_header_refold(struct im_header *hdr, int width);
 int im_header_write(struct list_head *lh, bfd_t *f);
-void im_header_free(struct im_header *hdr);
 
 #endif
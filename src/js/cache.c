@@ -0,0 +1,168 @@
+#include "cache.h"
+#include "../shm_cache.h"
+
+#include <errno.h>
+#include <string.h>
+
+/*
+ * The global "cache" object: a view of the key/value cache that all the
+ * workers share (see shm_cache.h). Keys and values are strings; numbers
+ * kept with incr() are stored in decimal.
+ *
+ *	cache.get(key)			the value, or null
+ *	cache.set(key, value[, ttl])	false if the entry is too large
+ *	cache.remove(key)		false if the key was not there
+ *	cache.incr(key[, delta[, ttl]])	the new value of the counter
+ */
+
+// Encode argument n as a C string; NULL (with an exception) on error
+static char *cache_arg_string(JSContext *cx, unsigned argc, jsval *vp, unsigned n) {
+	JSString *str;
+
+	if (argc <= n) {
+		JS_ReportError(cx, "cache: missing argument");
+		return NULL;
+	}
+
+	if ((str = JS_ValueToString(cx, JS_ARGV(cx, vp)[n])) == NULL) {
+		return NULL;
+	}
+
+	return JS_EncodeString(cx, str);
+}
+
+// Convert the optional argument n to an unsigned integer
+static JSBool cache_arg_uint(JSContext *cx, unsigned argc, jsval *vp, unsigned n, uint32_t *val) {
+	if (argc <= n || JSVAL_IS_VOID(JS_ARGV(cx, vp)[n])) {
+		return JS_TRUE;
+	}
+
+	return JS_ValueToECMAUint32(cx, JS_ARGV(cx, vp)[n], val);
+}
+
+static JSBool cache_get(JSContext *cx, unsigned argc, jsval *vp) {
+	char *key, val[SHM_CACHE_DATA];
+	ssize_t len;
+	JSString *str;
+
+	if ((key = cache_arg_string(cx, argc, vp, 0)) == NULL) {
+		return JS_FALSE;
+	}
+
+	len = shm_cache_get(key, strlen(key), val, sizeof(val));
+	JS_free(cx, key);
+
+	if (len < 0) {
+		JS_SET_RVAL(cx, vp, JSVAL_NULL);
+		return JS_TRUE;
+	}
+
+	if ((str = JS_NewStringCopyN(cx, val, len)) == NULL) {
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(str));
+	return JS_TRUE;
+}
+
+static JSBool cache_set(JSContext *cx, unsigned argc, jsval *vp) {
+	char *key, *val;
+	uint32_t ttl = 0;
+	int err;
+
+	if (!cache_arg_uint(cx, argc, vp, 2, &ttl)) {
+		return JS_FALSE;
+	}
+
+	if ((key = cache_arg_string(cx, argc, vp, 0)) == NULL) {
+		return JS_FALSE;
+	}
+
+	if ((val = cache_arg_string(cx, argc, vp, 1)) == NULL) {
+		JS_free(cx, key);
+		return JS_FALSE;
+	}
+
+	err = shm_cache_set(key, strlen(key), val, strlen(val), ttl);
+	JS_free(cx, key);
+	JS_free(cx, val);
+
+	JS_SET_RVAL(cx, vp, BOOLEAN_TO_JSVAL(err ? JS_FALSE : JS_TRUE));
+	return JS_TRUE;
+}
+
+static JSBool cache_remove(JSContext *cx, unsigned argc, jsval *vp) {
+	char *key;
+	int err;
+
+	if ((key = cache_arg_string(cx, argc, vp, 0)) == NULL) {
+		return JS_FALSE;
+	}
+
+	err = shm_cache_del(key, strlen(key));
+	JS_free(cx, key);
+
+	JS_SET_RVAL(cx, vp, BOOLEAN_TO_JSVAL(err ? JS_FALSE : JS_TRUE));
+	return JS_TRUE;
+}
+
+static JSBool cache_incr(JSContext *cx, unsigned argc, jsval *vp) {
+	char *key;
+	int32 delta = 1;
+	uint32_t ttl = 0;
+	long value;
+	int err;
+
+	if (argc > 1 && !JSVAL_IS_VOID(JS_ARGV(cx, vp)[1]) &&
+			!JS_ValueToInt32(cx, JS_ARGV(cx, vp)[1], &delta)) {
+		return JS_FALSE;
+	}
+
+	if (!cache_arg_uint(cx, argc, vp, 2, &ttl)) {
+		return JS_FALSE;
+	}
+
+	if ((key = cache_arg_string(cx, argc, vp, 0)) == NULL) {
+		return JS_FALSE;
+	}
+
+	err = shm_cache_incr(key, strlen(key), delta, ttl, &value);
+	JS_free(cx, key);
+
+	if (err) {
+		JS_ReportError(cx, "cache.incr: %s", strerror(-err));
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL(cx, vp, DOUBLE_TO_JSVAL((jsdouble)value));
+	return JS_TRUE;
+}
+
+static JSClass cache_class = {
+	"cache", 0, JS_PropertyStub, JS_PropertyStub, JS_PropertyStub,
+	JS_StrictPropertyStub, JS_EnumerateStub, JS_ResolveStub,
+	JS_ConvertStub, JS_PropertyStub, JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static JSFunctionSpec cache_methods[] = {
+	JS_FS("get", cache_get, 1, 0),
+	JS_FS("set", cache_set, 3, 0),
+	JS_FS("remove", cache_remove, 1, 0),
+	JS_FS("incr", cache_incr, 3, 0),
+	JS_FS_END
+};
+
+int js_cache_obj_init(JSContext *cx, JSObject *global) {
+	JSObject *cache;
+
+	cache = JS_DefineObject(cx, global, "cache", &cache_class, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT);
+	if (!cache) {
+		return -1;
+	}
+
+	if (!JS_DefineFunctions(cx, cache, cache_methods)) {
+		return -1;
+	}
+
+	return 0;
+}
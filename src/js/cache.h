@@ -0,0 +1,8 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "js.h"
+
+int js_cache_obj_init(JSContext *cx, JSObject *global);
+
+#endif
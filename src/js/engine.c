@@ -1,6 +1,15 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include "engine.h"
 #include "../config.h"
 #include "../logging.h"
+#include "../smtp_server.h"
 
 /* Function Summary */
 /*
@@ -9,6 +18,15 @@
  * 1. logging_hdlr()
  *	- Handles the object passed to the 'logging' property.
  *
+ * 2. gc_hdlr()
+ *	- Handles the object passed to the 'gc' property.
+ *
+ * 3. watchdog_hdlr()
+ *	- Handles the object passed to the 'watchdog' property.
+ *
+ * 4. cache_hdlr()
+ *	- Handles the object passed to the 'cache' property.
+ *
  * NATIVE FUNCTIONS:
  *
  * 1. load_module()
@@ -120,11 +138,147 @@ static JSBool debug_protocol_hdlr(JSContext *cx, JSObject *obj, jsval *vp)
 	return JS_TRUE;
 }
 
+static JSBool max_message_size_hdlr(JSContext *cx, JSObject *obj, jsval *vp)
+{
+	jsdouble size;
+
+	/* maxMessageSize not specified, leave it default */
+	if (JSVAL_IS_VOID(*vp))
+		return JS_TRUE;
+
+	if (!JSVAL_IS_NUMBER(*vp) || !JS_ValueToNumber(cx, *vp, &size))
+		return JS_FALSE;
+
+	if (size < 0) {
+		JS_ReportError(cx, "illegal value %f for \"maxMessageSize\"", size);
+		return JS_FALSE;
+	}
+
+	config.smtp_max_size = (unsigned long)size;
+
+	return JS_TRUE;
+}
+
+/* Get a non-negative number property; leave *val alone if not specified */
+static JSBool get_size_property(JSContext *cx, JSObject *obj, const char *name, unsigned long *val)
+{
+	jsval property_value;
+	jsdouble size;
+
+	if (!JS_GetProperty(cx, obj, name, &property_value))
+		return JS_FALSE;
+
+	if (JSVAL_IS_VOID(property_value))
+		return JS_TRUE;
+
+	if (!JSVAL_IS_NUMBER(property_value) || !JS_ValueToNumber(cx, property_value, &size))
+		return JS_FALSE;
+
+	if (size < 0 || size > 0xffffffff) {
+		JS_ReportError(cx, "illegal value %f for \"%s\"", size, name);
+		return JS_FALSE;
+	}
+
+	*val = (unsigned long)size;
+
+	return JS_TRUE;
+}
+
+static JSBool gc_hdlr(JSContext *cx, JSObject *obj, jsval *vp)
+{
+	JSObject *gc_obj;
+	jsval property_value;
+
+	/* gc not specified, leave it default */
+	if (JSVAL_IS_VOID(*vp))
+		return JS_TRUE;
+
+	if (JSVAL_IS_PRIMITIVE(*vp))
+		return JS_FALSE;
+	gc_obj = JSVAL_TO_OBJECT(*vp);
+
+	if (!get_size_property(cx, gc_obj, "maxBytes", &config.js_max_bytes))
+		return JS_FALSE;
+
+	if (!get_size_property(cx, gc_obj, "maxMallocBytes", &config.js_max_malloc_bytes))
+		return JS_FALSE;
+
+	if (!get_size_property(cx, gc_obj, "triggerFactor", &config.js_gc_trigger_factor))
+		return JS_FALSE;
+
+	if (!JS_GetProperty(cx, gc_obj, "betweenTransactions", &property_value))
+		return JS_FALSE;
+
+	if (JSVAL_IS_VOID(property_value))
+		return JS_TRUE;
+
+	if (!JSVAL_IS_BOOLEAN(property_value))
+		return JS_FALSE;
+
+	config.js_gc_transaction = JSVAL_TO_BOOLEAN(property_value) == JS_TRUE;
+
+	return JS_TRUE;
+}
+
+static JSBool watchdog_hdlr(JSContext *cx, JSObject *obj, jsval *vp)
+{
+	JSObject *watchdog_obj;
+	jsval property_value;
+
+	/* watchdog not specified, leave it default */
+	if (JSVAL_IS_VOID(*vp))
+		return JS_TRUE;
+
+	if (JSVAL_IS_PRIMITIVE(*vp))
+		return JS_FALSE;
+	watchdog_obj = JSVAL_TO_OBJECT(*vp);
+
+	if (!get_size_property(cx, watchdog_obj, "timeout", &config.js_handler_timeout))
+		return JS_FALSE;
+
+	if (!get_size_property(cx, watchdog_obj, "code", &config.js_timeout_code))
+		return JS_FALSE;
+
+	if (config.js_timeout_code < 400 || config.js_timeout_code > 599) {
+		JS_ReportError(cx, "illegal value %lu for \"code\"", config.js_timeout_code);
+		return JS_FALSE;
+	}
+
+	if (!JS_GetProperty(cx, watchdog_obj, "message", &property_value))
+		return JS_FALSE;
+
+	if (JSVAL_IS_VOID(property_value))
+		return JS_TRUE;
+
+	if (!JSVAL_IS_STRING(property_value))
+		return JS_FALSE;
+
+	/* kept for the lifetime of the process */
+	config.js_timeout_message = JS_EncodeString(cx, JSVAL_TO_STRING(property_value));
+	if (config.js_timeout_message == NULL)
+		return JS_FALSE;
+
+	return JS_TRUE;
+}
+
+static JSBool cache_hdlr(JSContext *cx, JSObject *obj, jsval *vp)
+{
+	/* cache not specified, leave it default */
+	if (JSVAL_IS_VOID(*vp))
+		return JS_TRUE;
+
+	if (JSVAL_IS_PRIMITIVE(*vp))
+		return JS_FALSE;
+
+	return get_size_property(cx, JSVAL_TO_OBJECT(*vp), "entries", &config.cache_entries);
+}
+
 static JSBool load_module(JSContext *cx, unsigned argc, jsval *vp)
 {
 	jsval module;
 	JSString *module_str;
-	char *module_name;
+	char *module_name, *path;
+	struct smtp_module *mod;
 
 	module = JS_ARGV(cx, vp)[0];
 
@@ -136,9 +290,45 @@ static JSBool load_module(JSContext *cx, unsigned argc, jsval *vp)
 	if (!module_name)
 		return JS_FALSE;
 
-	log(&config, LOG_INFO, "[STUB] Loading module \"%s\".\n", module_name);
-
+	/* Bare names are looked up in the module directory */
+	if (strchr(module_name, '/') == NULL) {
+		if (asprintf(&path, "%s/%s", SMTP_MODULE_DIR, module_name) < 0) {
+			JS_free(cx, module_name);
+			JS_ReportOutOfMemory(cx);
+			return JS_FALSE;
+		}
+	} else if ((path = strdup(module_name)) == NULL) {
+		JS_free(cx, module_name);
+		JS_ReportOutOfMemory(cx);
+		return JS_FALSE;
+	}
 	JS_free(cx, module_name);
+
+	/* A module that is not installed only disables its features;
+	 * loadModule() returns false so the script can tell */
+	if (access(path, F_OK) && errno == ENOENT) {
+		log(&config, LOG_WARNING, "Module %s not found; skipping.\n", path);
+		free(path);
+		JS_SET_RVAL(cx, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	mod = smtp_module_load(path);
+	if (!mod) {
+		JS_ReportError(cx, "could not load module \"%s\"", path);
+		free(path);
+		return JS_FALSE;
+	}
+
+	log(&config, LOG_INFO, "Loaded module \"%s\" from %s.\n", mod->name, path);
+	free(path);
+
+	if (mod->js_init != NULL && mod->js_init(cx, JS_GetGlobalForScopeChain(cx))) {
+		JS_ReportError(cx, "module \"%s\" failed to define its JS bindings", mod->name);
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL(cx, vp, JSVAL_TRUE);
 	return JS_TRUE;
 }
 
@@ -164,6 +354,30 @@ int js_engine_parse(JSContext *cx, JSObject *global)
 	if (!debug_protocol_hdlr(cx, global, &prop_val))
 		return -1;
 
+	/* Parse 'maxMessageSize' property. */
+	if (!JS_GetProperty(cx, engine, "maxMessageSize", &prop_val))
+		return -1;
+	if (!max_message_size_hdlr(cx, global, &prop_val))
+		return -1;
+
+	/* Parse 'gc' property. */
+	if (!JS_GetProperty(cx, engine, "gc", &prop_val))
+		return -1;
+	if (!gc_hdlr(cx, global, &prop_val))
+		return -1;
+
+	/* Parse 'watchdog' property. */
+	if (!JS_GetProperty(cx, engine, "watchdog", &prop_val))
+		return -1;
+	if (!watchdog_hdlr(cx, global, &prop_val))
+		return -1;
+
+	/* Parse 'cache' property. */
+	if (!JS_GetProperty(cx, engine, "cache", &prop_val))
+		return -1;
+	if (!cache_hdlr(cx, global, &prop_val))
+		return -1;
+
 	return 0;
 }
 
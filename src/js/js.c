@@ -6,16 +6,297 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/time.h>
+#include <openssl/sha.h>
 
 #include "../config.h"
 #include "js.h"
 #include "engine.h"
+#include "cache.h"
 #include "../string_tools.h"
+#include "../mime.h"
 
 JSContext *js_context;
 
 static JSRuntime *rt;
 
+/*
+ * Objects that the session setters need on every command. They are looked
+ * up once and rooted; js_invalidate_handles() bumps js_handles_generation
+ * when a script assigns one of the names below, so that the next user
+ * looks them up again.
+ */
+static struct {
+	unsigned int generation;
+	JSObject *global;
+	JSObject *session;		/* smtpServer.session */
+	JSObject *smtp_client;	/* smtpClient, NULL if not defined */
+	jsval response_ctor;	/* SmtpResponse */
+	jsval header_ctor;		/* Header */
+} js_handles;
+
+static unsigned int js_handles_generation = 1;
+
+static const char *js_handle_names[] = {
+	"smtpServer", "session", "smtpClient", "SmtpResponse", "Header"
+};
+
+/* Called by the property hooks of the global and smtpServer objects */
+void js_invalidate_handles(JSContext *cx, jsid id)
+{
+	const jschar *chars;
+	jsval idval;
+	size_t len, i, j;
+
+	if (!JS_IdToValue(cx, id, &idval) || !JSVAL_IS_STRING(idval))
+		return;
+
+	chars = JS_GetStringCharsAndLength(cx, JSVAL_TO_STRING(idval), &len);
+	if (chars == NULL)
+		return;
+
+	for (i = 0; i < sizeof(js_handle_names) / sizeof(js_handle_names[0]); i++) {
+		for (j = 0; j < len && js_handle_names[i][j] == chars[j]; j++);
+		if (j == len && js_handle_names[i][j] == '\0') {
+			js_handles_generation++;
+			return;
+		}
+	}
+}
+
+static int js_get_handles(void)
+{
+	jsval v;
+
+	if (js_handles.generation == js_handles_generation)
+		return 0;
+
+	if (!JS_GetProperty(js_context, js_handles.global, "smtpServer", &v) || JSVAL_IS_PRIMITIVE(v))
+		return -1;
+	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(v), "session", &v) || JSVAL_IS_PRIMITIVE(v))
+		return -1;
+	js_handles.session = JSVAL_TO_OBJECT(v);
+
+	if (!JS_GetProperty(js_context, js_handles.global, "smtpClient", &v))
+		return -1;
+	js_handles.smtp_client = JSVAL_IS_PRIMITIVE(v) ? NULL : JSVAL_TO_OBJECT(v);
+
+	if (!JS_GetProperty(js_context, js_handles.global, "SmtpResponse", &js_handles.response_ctor) ||
+			!JS_GetProperty(js_context, js_handles.global, "Header", &js_handles.header_ctor))
+		return -1;
+
+	js_handles.generation = js_handles_generation;
+	return 0;
+}
+
+static int js_init_handles(JSObject *global)
+{
+	js_handles.global = global;
+
+	if (!JS_AddNamedObjectRoot(js_context, &js_handles.session, "js_handles.session") ||
+			!JS_AddNamedObjectRoot(js_context, &js_handles.smtp_client, "js_handles.smtp_client") ||
+			!JS_AddNamedValueRoot(js_context, &js_handles.response_ctor, "js_handles.response_ctor") ||
+			!JS_AddNamedValueRoot(js_context, &js_handles.header_ctor, "js_handles.header_ctor"))
+		return -1;
+
+	return 0;
+}
+
+static JSBool global_setProperty(JSContext *cx, JSObject *obj, jsid id, JSBool strict, jsval *vp)
+{
+	js_invalidate_handles(cx, id);
+	return JS_TRUE;
+}
+
+static JSBool global_delProperty(JSContext *cx, JSObject *obj, jsid id, jsval *vp)
+{
+	js_invalidate_handles(cx, id);
+	return JS_TRUE;
+}
+
+/* GC activity since the session started */
+static struct js_gc_stats js_gc_stats;
+static struct timespec js_gc_start;
+
+static JSBool js_gc_callback(JSContext *cx, JSGCStatus status)
+{
+	struct timespec now;
+	unsigned long pause;
+
+	switch (status) {
+	case JSGC_BEGIN:
+		clock_gettime(CLOCK_MONOTONIC, &js_gc_start);
+		break;
+	case JSGC_END:
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pause = (now.tv_sec - js_gc_start.tv_sec) * 1000000 +
+			(now.tv_nsec - js_gc_start.tv_nsec) / 1000;
+		js_gc_stats.count++;
+		js_gc_stats.pause += pause;
+		if (pause > js_gc_stats.max_pause)
+			js_gc_stats.max_pause = pause;
+		break;
+	default:
+		break;
+	}
+
+	return JS_TRUE;
+}
+
+/*
+ * Apply the engine.gc settings. The runtime is created before the
+ * configuration script runs, so they can only be applied afterwards.
+ */
+static void js_gc_configure(void)
+{
+	if (config.js_max_bytes)
+		JS_SetGCParameter(rt, JSGC_MAX_BYTES, (uint32)config.js_max_bytes);
+	if (config.js_max_malloc_bytes)
+		JS_SetGCParameter(rt, JSGC_MAX_MALLOC_BYTES, (uint32)config.js_max_malloc_bytes);
+	if (config.js_gc_trigger_factor)
+		JS_SetGCParameter(rt, JSGC_TRIGGER_FACTOR, (uint32)config.js_gc_trigger_factor);
+}
+
+void js_gc_transaction(void)
+{
+	if (config.js_gc_transaction)
+		JS_MaybeGC(js_context);
+}
+
+const struct js_gc_stats *js_get_gc_stats(void)
+{
+	return &js_gc_stats;
+}
+
+/*
+ * Handler watchdog. The CPU time timer (ITIMER_PROF) is armed around
+ * every handler call. JS_TriggerOperationCallback() is not async-signal-
+ * safe, so the signal handler only records the expiry and wakes up the
+ * watchdog thread, which asks the engine to call js_operation_callback()
+ * as soon as possible; the callback then aborts the script.
+ */
+static volatile sig_atomic_t js_watchdog_expired;
+static sem_t js_watchdog_sem;
+/* Threads do not survive fork(), so every worker starts its own */
+static pid_t js_watchdog_pid;
+
+static void js_watchdog_sigaction(int sig)
+{
+	js_watchdog_expired = 1;
+	sem_post(&js_watchdog_sem);
+}
+
+static void *js_watchdog_thread(void *arg)
+{
+	for (;;) {
+		if (sem_wait(&js_watchdog_sem))
+			continue;
+		if (js_watchdog_expired)
+			JS_TriggerOperationCallback(js_context);
+	}
+
+	return NULL;
+}
+
+static JSBool js_operation_callback(JSContext *cx)
+{
+	/* returning false terminates the script; it cannot be caught */
+	return !js_watchdog_expired;
+}
+
+static int js_watchdog_init(void)
+{
+	struct sigaction act = {
+		.sa_handler = js_watchdog_sigaction,
+		.sa_flags = SA_RESTART
+	};
+
+	sigemptyset(&act.sa_mask);
+	if (sigaction(SIGPROF, &act, NULL))
+		return -1;
+
+	JS_SetOperationCallback(js_context, js_operation_callback);
+	return 0;
+}
+
+/*
+ * Start the watchdog thread of this process. SIGPROF is blocked in the
+ * thread, so that the signal interrupts the thread that runs the script.
+ */
+static int js_watchdog_thread_start(void)
+{
+	sigset_t set, old;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	if (js_watchdog_pid == getpid())
+		return 0;
+
+	if (sem_init(&js_watchdog_sem, 0, 0))
+		return -1;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPROF);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, js_watchdog_thread, NULL);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		sem_destroy(&js_watchdog_sem);
+		return -1;
+	}
+
+	js_watchdog_pid = getpid();
+	return 0;
+}
+
+void js_watchdog_start(void)
+{
+	struct itimerval it = {
+		.it_value = {
+			.tv_sec = config.js_handler_timeout / 1000,
+			.tv_usec = (config.js_handler_timeout % 1000) * 1000
+		}
+	};
+
+	js_watchdog_expired = 0;
+	if (!config.js_handler_timeout)
+		return;
+
+	/* without the thread, the timer would be of no use */
+	if (js_watchdog_thread_start()) {
+		fprintf(stderr, "%s: ERROR: could not start the watchdog thread\n", __func__);
+		return;
+	}
+
+	setitimer(ITIMER_PROF, &it, NULL);
+}
+
+int js_watchdog_stop(void)
+{
+	struct itimerval it = {};
+	int expired;
+
+	if (config.js_handler_timeout)
+		setitimer(ITIMER_PROF, &it, NULL);
+
+	/* a callback that is still pending must not abort other code */
+	expired = js_watchdog_expired;
+	js_watchdog_expired = 0;
+
+	return expired;
+}
+
 /* The error reporter callback. */
 static void reportError(JSContext *js_context, const char *message, JSErrorReport *report)
 {
@@ -24,17 +305,27 @@ static void reportError(JSContext *js_context, const char *message, JSErrorRepor
 }
 
 jsval js_create_response(jsval *argv) {
-	jsval response;
-	JSObject *global;
+	jsval response = JSVAL_NULL;
 
-	global = JS_GetGlobalForScopeChain(js_context);
+	if (js_get_handles()) {
+		return JSVAL_NULL;
+	}
 
-	JS_CallFunctionName(js_context, global, "SmtpResponse",
+	JS_CallFunctionValue(js_context, js_handles.global, js_handles.response_ctor,
 				3, argv, &response);
 
 	return response;
 }
 
+JSBool js_new_header(jsval *argv, jsval *rval) {
+	if (js_get_handles()) {
+		return JS_FALSE;
+	}
+
+	return JS_CallFunctionValue(js_context, js_handles.global, js_handles.header_ctor,
+				2, argv, rval);
+}
+
 int js_get_code(jsval v) {
 	jsval code;
 
@@ -84,7 +375,7 @@ char *js_get_message(jsval v) {
 				free(c_str);
 			}
 
-			return sb.s;
+			return string_buffer_detach(&sb);
 		default:
 			break;
 	}
@@ -106,23 +397,12 @@ int js_get_disconnect(jsval v) {
 }
 
 int js_set_quitAsserted() {
-	jsval session, smtpServer;
-	JSObject *global;
-
-	global = JS_GetGlobalForScopeChain(js_context);
-
-	// Get smtpServer
-	if (!JS_GetProperty(js_context, global, "smtpServer", &smtpServer)) {
-		return -1;
-	}
-
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(smtpServer), "session", &session)) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
 	// Define and set session.quitAsserted = false
-	if (JS_DefineProperty(js_context, JSVAL_TO_OBJECT(session), "quitAsserted", BOOLEAN_TO_JSVAL(JS_TRUE), NULL, NULL, JSPROP_ENUMERATE) == JS_FALSE) {
+	if (JS_DefineProperty(js_context, js_handles.session, "quitAsserted", BOOLEAN_TO_JSVAL(JS_TRUE), NULL, NULL, JSPROP_ENUMERATE) == JS_FALSE) {
 		return -1;
 	}
 
@@ -130,201 +410,177 @@ int js_set_quitAsserted() {
 }
 
 int add_body_stream(bfd_t *body_stream) {
-	jsval smtpClient, bodyStream;
-	JSObject *global;
-
-	global = JS_GetGlobalForScopeChain(js_context);
+	jsval bodyStream;
 
-	// Get smtpClient
-	if (!JS_GetProperty(js_context, global, "smtpClient", &smtpClient)) {
+	if (js_get_handles() || js_handles.smtp_client == NULL) {
 		return -1;
 	}
 
 	bodyStream = PRIVATE_TO_JSVAL(body_stream);
 
 	// Add path property
-	if (!JS_SetProperty(js_context, JSVAL_TO_OBJECT(smtpClient), "bodyStream", &bodyStream)) {
+	if (!JS_SetProperty(js_context, js_handles.smtp_client, "bodyStream", &bodyStream)) {
 		return -1;
 	}
 
 	return 0;
 }
 
-int add_path_local(jsval *smtpPath, char *local) {
-	jsval mailbox;
+// Upstream stream that smtpClient.connect() opened, or NULL
+bfd_t *js_smtp_client_stream(void) {
+	jsval clientStream;
 
-	// Get smtpPath.mailbox property
-	if (JS_GetProperty(js_context, JSVAL_TO_OBJECT(*smtpPath), "mailbox", &mailbox) == JS_FALSE) {
-		return -1;
+	if (js_get_handles() || js_handles.smtp_client == NULL) {
+		return NULL;
 	}
 
-	// Set smtpPath.local
-	if (!JS_DefineProperty(js_context, JSVAL_TO_OBJECT(mailbox), "local", STRING_TO_JSVAL(JS_InternString(js_context, local)), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
-		return -1;
+	if (!JS_GetProperty(js_context, js_handles.smtp_client, "clientStream", &clientStream) ||
+			JSVAL_IS_VOID(clientStream) || JSVAL_IS_NULL(clientStream)) {
+		return NULL;
 	}
 
-	return 0;
+	return JSVAL_TO_PRIVATE(clientStream);
 }
 
-int add_path_domain(jsval *smtpPath, char *domain) {
-	jsval mailbox;
+static int set_mime_part_string(JSObject *obj, const char *name, const char *value) {
+	jsval val = JSVAL_NULL;
 
-	// Get smtpPath.mailbox property
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(*smtpPath), "mailbox", &mailbox)) {
-		return -1;
-	}
+	if (value != NULL)
+		val = STRING_TO_JSVAL(JS_NewStringCopyZ(js_context, value));
 
-	// Set smtpPath.local
-	if (!JS_DefineProperty(js_context, JSVAL_TO_OBJECT(mailbox), "domain", STRING_TO_JSVAL(JS_InternString(js_context, domain)), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
+	if (!JS_DefineProperty(js_context, obj, name, val, NULL, NULL, JSPROP_ENUMERATE)) {
 		return -1;
 	}
 
 	return 0;
 }
 
-int add_domain(jsval *smtpPath, char *domain) {
-	jsval domains;
-	uint32_t arr_len;
+int set_mime_parts(struct list_head *parts) {
+	jsval mimeParts;
+	JSObject *arr, *obj;
+	struct mime_part *part;
+	int i = 0;
 
-	// Get smtpPath.domains property
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(*smtpPath), "domains", &domains)) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
-	// Get number of recipients
-	if (!JS_GetArrayLength(js_context, JSVAL_TO_OBJECT(domains), &arr_len)) {
+	// The array is reused by all transactions
+	if ((arr = reset_session_mime_parts(js_context)) == NULL) {
 		return -1;
 	}
 
-	// Add recipient
-	if (!JS_DefineElement(js_context, JSVAL_TO_OBJECT(domains), arr_len, STRING_TO_JSVAL(JS_InternString(js_context, domain)), NULL, NULL, 0)) {
+	mimeParts = OBJECT_TO_JSVAL(arr);
+	if (!JS_SetProperty(js_context, js_handles.session, "mimeParts", &mimeParts)) {
 		return -1;
 	}
 
-	return 0;
-}
-
-int set_envelope_sender(jsval *smtpPath) {
-	jsval session, smtpServer;
-	JSObject *global;
+	if (parts == NULL) {
+		return 0;
+	}
 
-	global = JS_GetGlobalForScopeChain(js_context);
+	list_for_each_entry(part, parts, lh) {
+		if ((obj = JS_NewObject(js_context, NULL, NULL, NULL)) == NULL) {
+			return -1;
+		}
 
-	// Get smtpServer
-	if (!JS_GetProperty(js_context, global, "smtpServer", &smtpServer)) {
-		return -1;
-	}
+		if (!JS_DefineElement(js_context, arr, i++, OBJECT_TO_JSVAL(obj), NULL, NULL, JSPROP_ENUMERATE)) {
+			return -1;
+		}
 
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(smtpServer), "session", &session)) {
-		return -1;
-	}
+		if (!JS_DefineProperty(js_context, obj, "depth", INT_TO_JSVAL(part->depth), NULL, NULL, JSPROP_ENUMERATE) ||
+				!JS_DefineProperty(js_context, obj, "offset", INT_TO_JSVAL(part->body_start), NULL, NULL, JSPROP_ENUMERATE) ||
+				!JS_DefineProperty(js_context, obj, "length", INT_TO_JSVAL(part->body_end - part->body_start), NULL, NULL, JSPROP_ENUMERATE)) {
+			return -1;
+		}
 
-	// Set session.envelopeSender
-	if (!JS_SetProperty(js_context, JSVAL_TO_OBJECT(session), "envelopeSender", smtpPath)) {
-		return -1;
+		if (set_mime_part_string(obj, "contentType", part->type) ||
+				set_mime_part_string(obj, "encoding", part->encoding) ||
+				set_mime_part_string(obj, "filename", part->filename)) {
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
-int add_recipient(jsval *smtpPath) {
-	jsval session, smtpServer, recipients;
-	JSObject *global;
-
-	global = JS_GetGlobalForScopeChain(js_context);
-	uint32_t arr_len;
-
-	// Get smtpServer
-	if (!JS_GetProperty(js_context, global, "smtpServer", &smtpServer)) {
+/*
+ * Start a new transaction on the session object: the envelope properties
+ * are bound to the (empty) native envelope, and the pooled headers and
+ * MIME parts objects are emptied. Nothing of the previous transaction
+ * remains visible to scripts.
+ */
+int js_session_reset(struct smtp_path *rpath, struct list_head *fpath) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(smtpServer), "session", &session)) {
+	if (define_envelope_sender(js_context, js_handles.session, rpath) ||
+			define_recipients(js_context, js_handles.session, fpath)) {
 		return -1;
 	}
 
-	// Get current recipients
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(session), "recipients", &recipients)) {
+	if (set_headers(NULL) || set_mime_parts(NULL)) {
 		return -1;
 	}
 
-	// Get number of recipients
-	if (!JS_GetArrayLength(js_context, JSVAL_TO_OBJECT(recipients), &arr_len)) {
-		return -1;
-	}
+	return 0;
+}
 
-	// Add recipient
-	if (!JS_DefineElement(js_context, JSVAL_TO_OBJECT(recipients), arr_len, *smtpPath, NULL, NULL, 0)) {
+int set_envelope_sender(struct smtp_path *path) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
-	return 0;
+	// The SmtpPath object is created on first use, from the native path
+	return define_envelope_sender(js_context, js_handles.session, path);
 }
 
-jsval new_smtp_path_instance(char *arg) {
-	jsval path, session, smtpPathClass, smtpServer;
-	JSObject *global;
-
-	global = JS_GetGlobalForScopeChain(js_context);
-
-	// Get smtpServer
-	if (!JS_GetProperty(js_context, global, "smtpServer", &smtpServer)) {
-		return JSVAL_NULL;
+int add_recipient(struct smtp_path *path) {
+	if (js_get_handles()) {
+		return -1;
 	}
 
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(smtpServer), "session", &session)) {
-		return JSVAL_NULL;
-	}
+	return append_recipient(js_context, js_handles.session, path);
+}
 
-	// Get smtpPathClass
-	if (!JS_GetProperty(js_context, global, "SmtpPath", &smtpPathClass)) {
-		return JSVAL_NULL;
+int drop_recipient(struct smtp_path *path) {
+	if (js_get_handles()) {
+		return -1;
 	}
 
-
-	jsval argv = STRING_TO_JSVAL(JS_InternString(js_context, arg));
-
-	JS_CallFunctionName(js_context, global, "SmtpPath",
-				1, &argv, &path);
-
-	return path;
+	return remove_recipient(js_context, js_handles.session, path);
 }
 
-int add_new_header(jsval *header) {
-	jsval session, smtpServer, headers;
-	JSObject *global;
-	uint32_t arr_len;
+int set_headers(struct smtp_server_context *ctx) {
+	jsval headers;
+	JSObject *headers_obj;
 
-	global = JS_GetGlobalForScopeChain(js_context);
-
-	// Get smtpServer
-	if (!JS_GetProperty(js_context, global, "smtpServer", &smtpServer)) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(smtpServer), "session", &session)) {
+	// Header objects are created on demand, from the native list
+	if ((headers_obj = reset_session_headers(js_context, ctx)) == NULL) {
 		return -1;
 	}
 
-	// Get session
-	if (!JS_GetProperty(js_context, JSVAL_TO_OBJECT(session), "headers", &headers)) {
+	headers = OBJECT_TO_JSVAL(headers_obj);
+	if (!JS_SetProperty(js_context, js_handles.session, "headers", &headers)) {
 		return -1;
 	}
 
-	// Get number of headers
-	if (!JS_GetArrayLength(js_context, JSVAL_TO_OBJECT(headers), &arr_len)) {
-		return -1;
-	}
+	return 0;
+}
 
-	// Add header
-	if (!JS_SetElement(js_context, JSVAL_TO_OBJECT(headers), arr_len, header)) {
+int sync_headers(void) {
+	if (js_get_handles()) {
 		return -1;
 	}
 
+	return sync_session_headers(js_context);
+}
+
 int add_header_properties(jsval *header, jsval *name, jsval *parts_recv) {
 	int i;
 	uint32_t arr_len;
@@ -373,12 +629,10 @@ int add_header_properties(jsval *header, jsval *name, jsval *parts_recv) {
 }
 
 jsval new_header_instance(char *name) {
-	jsval header, js_name;
-	JSObject *global, *parts_obj;
-
-	global = JS_GetGlobalForScopeChain(js_context);
+	jsval header = JSVAL_NULL, js_name;
+	JSObject *parts_obj;
 
-	js_name = STRING_TO_JSVAL(JS_InternString(js_context, name));
+	js_name = STRING_TO_JSVAL(JS_NewStringCopyZ(js_context, name));
 
 	parts_obj = JS_NewArrayObject(js_context, 0, NULL);
 
@@ -386,8 +640,7 @@ jsval new_header_instance(char *name) {
 
 	jsval argv[2] = {js_name, js_parts};
 
-	JS_CallFunctionName(js_context, global, "Header",
-				2, argv, &header);
+	js_new_header(argv, &header);
 
 	return header;
 }
@@ -406,7 +659,7 @@ int add_part_to_header(jsval *header, char *c_str) {
 		return 1;
 	}
 
-	part = STRING_TO_JSVAL(JS_InternString(js_context, c_str));
+	part = STRING_TO_JSVAL(JS_NewStringCopyZ(js_context, c_str));
 
 	// Add part to array
 	if (!JS_SetElement(js_context, JSVAL_TO_OBJECT(parts), parts_len, &part)) {
@@ -453,40 +706,13 @@ void js_dump_value(JSContext *cx, jsval v)
 }
 
 jsval call_js_handler(const char *cmd) {
-    int i;
-    char handler_name[9];
-
-    strcpy(handler_name, "smtp");
-
-    handler_name[4] = toupper((unsigned char) cmd[0]);
-
-    for (i = 5; i < 8; i++) {
-        handler_name[i] = tolower((unsigned char) cmd[i - 4]);
-    }
-
-    handler_name[8] = '\0';
-        
-    return js_call("smtpServer", handler_name, JSVAL_NULL);
+    return js_smtp_server_call(cmd, 0, NULL);
 }
 
 jsval call_js_handler_with_arg(const char *cmd, char *arg) {
-    int i;
-    char handler_name[9];
-
-
-    strcpy(handler_name, "smtp");
-
-    handler_name[4] = toupper((unsigned char) cmd[0]);
+    jsval js_arg = STRING_TO_JSVAL(JS_NewStringCopyZ(js_context, arg));
 
-    for (i = 5; i < 8; i++) {
-        handler_name[i] = tolower((unsigned char) cmd[i - 4]);
-    }
-
-    handler_name[8] = '\0';
-
-    jsval js_arg = STRING_TO_JSVAL(JS_InternString(js_context, arg));
-
-    return js_call("smtpServer", handler_name, js_arg, JSVAL_NULL);
+    return js_smtp_server_call(cmd, 1, &js_arg);
 }
 
 jsval js_call(const char *obj, const char *func, jsval arg, ...)
@@ -540,9 +766,144 @@ jsval js_call(const char *obj, const char *func, jsval arg, ...)
 	return rval;
 }
 
+/*
+ * Compiled configuration script cache. The file holds the XDR encoding
+ * of the script, preceded by this header; the SHA-1 of the source tells
+ * whether the cached bytecode is still current.
+ */
+#define JS_CACHE_MAGIC "mailfilter-xdr-1"
+
+struct js_cache_hdr {
+	char magic[16];
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	uint32_t len;
+};
+
+static JSObject *js_cache_load(const char *path, const unsigned char *hash)
+{
+	struct js_cache_hdr hdr;
+	JSObject *script = NULL;
+	JSXDRState *xdr;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			memcmp(hdr.magic, JS_CACHE_MAGIC, sizeof(hdr.magic)) ||
+			memcmp(hdr.hash, hash, SHA_DIGEST_LENGTH) || !hdr.len)
+		goto out_close;
+
+	if ((data = malloc(hdr.len)) == NULL)
+		goto out_close;
+
+	if (read(fd, data, hdr.len) != hdr.len)
+		goto out_free;
+
+	if ((xdr = JS_XDRNewMem(js_context, JSXDR_DECODE)) == NULL)
+		goto out_free;
+
+	JS_XDRMemSetData(xdr, data, hdr.len);
+	if (!JS_XDRScriptObject(xdr, &script)) {
+		/* e.g. bytecode from a different engine version */
+		JS_ClearPendingException(js_context);
+		script = NULL;
+	}
+
+	/* The buffer is ours, don't let JS_XDRDestroy() free it */
+	JS_XDRMemSetData(xdr, NULL, 0);
+	JS_XDRDestroy(xdr);
+
+out_free:
+	free(data);
+out_close:
+	close(fd);
+	return script;
+}
+
+static void js_cache_save(const char *path, const unsigned char *hash, JSObject *script)
+{
+	struct js_cache_hdr hdr;
+	JSXDRState *xdr;
+	char *tmp;
+	void *data;
+	uint32 len;
+	int fd;
+
+	if ((xdr = JS_XDRNewMem(js_context, JSXDR_ENCODE)) == NULL)
+		return;
+
+	if (!JS_XDRScriptObject(xdr, &script) ||
+			(data = JS_XDRMemGetData(xdr, &len)) == NULL)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JS_CACHE_MAGIC, sizeof(hdr.magic));
+	memcpy(hdr.hash, hash, SHA_DIGEST_LENGTH);
+	hdr.len = len;
+
+	/* Write a temporary file and rename it, so that concurrent
+	 * readers never see a partial cache file */
+	if ((tmp = malloc(strlen(path) + 8)) == NULL)
+		goto out;
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	if ((fd = mkstemp(tmp)) < 0)
+		goto out_free;
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, data, len) != len) {
+		close(fd);
+		unlink(tmp);
+		goto out_free;
+	}
+
+	if (close(fd) || rename(tmp, path))
+		unlink(tmp);
+
+out_free:
+	free(tmp);
+out:
+	JS_XDRDestroy(xdr);
+}
+
+/*
+ * Compile the configuration script, or load its bytecode from the cache
+ * if the source did not change since it was compiled.
+ */
+static JSObject *js_compile_config(JSObject *global, const char *filename, const char *buf, size_t len)
+{
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	char *path = (char *)config.script_cache;
+	JSObject *script;
+
+	if (path == NULL) {
+		if ((path = malloc(strlen(filename) + 5)) == NULL)
+			return NULL;
+		sprintf(path, "%s.xdr", filename);
+	}
+
+	SHA1((const unsigned char *)buf, len, hash);
+
+	script = js_cache_load(path, hash);
+	if (script == NULL) {
+		script = JS_CompileScript(js_context, global, buf, len, filename, 0);
+		if (script != NULL)
+			js_cache_save(path, hash, script);
+	}
+
+	if (path != config.script_cache)
+		free(path);
+
+	return script;
+}
+
 int js_init(const char *filename)
 {
-	JSObject *global;
+	JSObject *global, *script;
+	jsval rval;
 
 	int fd;
 	void *buf;
@@ -551,13 +912,13 @@ int js_init(const char *filename)
 	/* The class of the global object. */
 	static JSClass global_class = {
 		"global", JSCLASS_GLOBAL_FLAGS, JS_PropertyStub,
-		JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+		global_delProperty, JS_PropertyStub, global_setProperty,
 		JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub,
 		JS_PropertyStub, JSCLASS_NO_OPTIONAL_MEMBERS
 	};
 
 	/* Create a JS runtime. You always need at least one runtime per process. */
-	rt = JS_NewRuntime(8 * 1024 * 1024);
+	rt = JS_NewRuntime(config.js_max_bytes ? config.js_max_bytes : 8 * 1024 * 1024);
 	if (rt == NULL)
 		return -1;
 	/*
@@ -570,6 +931,9 @@ int js_init(const char *filename)
 	JS_SetOptions(js_context, JSOPTION_VAROBJFIX | JSOPTION_METHODJIT);
 	JS_SetVersion(js_context, JSVERSION_LATEST);
 	JS_SetErrorReporter(js_context, reportError);
+	JS_SetGCCallback(js_context, js_gc_callback);
+	if (js_watchdog_init())
+		return -1;
 
 	/*
 	 * Create the global object in a new compartment.
@@ -586,6 +950,9 @@ int js_init(const char *filename)
 	if (!JS_InitStandardClasses(js_context, global))
 		return -1;
 
+	if (js_init_handles(global))
+		return -1;
+
 	/* Read the file into memory */
 	fd = open(filename, O_RDONLY, 0);
 	if (fd < 0) {
@@ -612,14 +979,39 @@ int js_init(const char *filename)
 		return -1;
 	if (js_smtp_server_obj_init(js_context, global))
 		return -1;
+	if (js_cache_obj_init(js_context, global))
+		return -1;
+
+	/* Run script; errors are reported by reportError() */
+	script = js_compile_config(global, filename, buf, len);
+	munmap(buf, len);
+	close(fd);
+
+	/* The error was reported by reportError(); starting with a partial
+	 * configuration would be worse than not starting at all */
+	if (script == NULL || !JS_ExecuteScript(js_context, global, script, &rval)) {
+		fprintf(stderr, "%s: ERROR: could not run %s\n", __func__, filename);
+		return -1;
+	}
 
-	/* Run script */
-	JS_EvaluateScript(js_context, global, buf, len, filename, 0, NULL);
+	/* Bind the command handlers that the script defined */
+	if (js_smtp_server_resolve_hdlrs(js_context))
+		return -1;
+
+	/* Build the native decision table from smtpServer.rules */
+	if (js_smtp_server_compile_rules(js_context))
+		return -1;
 
 	/* Evaluate the changes caused by the script */
 	if (js_engine_parse(js_context, global))
 		return -1;
 
+	/* Workers are forked from here: let them start with a clean heap
+	 * and their own GC statistics */
+	js_gc_configure();
+	JS_GC(js_context);
+	memset(&js_gc_stats, 0, sizeof(js_gc_stats));
+
 	return 0;
 }
 
@@ -3,6 +3,8 @@
 
 #include <jsapi.h>
 #include "../bfd.h"
+#include "../list.h"
+#include "../smtp.h"
 
 #ifdef DEBUG
 
@@ -14,12 +16,35 @@ some macros (like JSVAL_NULL).
 
 extern JSContext *js_context;
 
+struct smtp_server_context;
+struct headers_view;
+
 /* Initializes JavaScript engine */
 int js_init(const char *filename);
 
 /* Closes JavaScript engine and frees its resources */
 void js_stop(void);
 
+/* Garbage collector activity of the session */
+struct js_gc_stats {
+	unsigned int count;
+	/* Time spent in the collector, in microseconds */
+	unsigned long pause, max_pause;
+};
+
+/*
+ * Enforce the engine.watchdog CPU time budget on the JS code that runs
+ * between the two calls. js_watchdog_stop() returns nonzero if the
+ * budget was exceeded (and the script aborted).
+ */
+void js_watchdog_start(void);
+int js_watchdog_stop(void);
+
+/* Collects garbage at the end of a transaction, if configured so */
+void js_gc_transaction(void);
+
+const struct js_gc_stats *js_get_gc_stats(void);
+
 /*
  * Calls the given function of the given predefined object with the given
  * arguments. Last parameter of the function should ALWAYS be JSVAL_NULL.
@@ -28,26 +53,47 @@ jsval js_call(const char *obj, const char *func, jsval arg, ...);
 jsval call_js_handler(const char *cmd);
 jsval call_js_handler_with_arg(const char *cmd, char *arg);
 
+// smtpServer handler dispatch
+int js_smtp_server_resolve_hdlrs(JSContext *cx);
+jsval js_smtp_server_call(const char *cmd, unsigned argc, jsval *argv);
+int js_smtp_server_compile_rules(JSContext *cx);
+
 // Get response properties
 int js_get_code(jsval v);
 char *js_get_message(jsval v);
 int js_get_disconnect(jsval v);
 jsval js_create_response(jsval *argv);
+JSBool js_new_header(jsval *argv, jsval *rval);
+void js_invalidate_handles(JSContext *cx, jsid id);
+
+// Session object
+int js_session_reset(struct smtp_path *rpath, struct list_head *fpath);
+JSObject *reset_session_headers(JSContext *cx, struct smtp_server_context *ctx);
+int sync_session_headers(JSContext *cx);
+JSObject *reset_session_mime_parts(JSContext *cx);
 
 // SmtpPath class methods
-int add_path_local(jsval *smtpPath, char *local);
-int add_path_domain(jsval *smtpPath, char *domain);
-int add_domain(jsval *smtpPath, char *domain);
-int set_envelope_sender(jsval *smtpPath);
-int add_recipient(jsval *smtpPath);
-jsval new_smtp_path_instance();
+int set_envelope_sender(struct smtp_path *path);
+int add_recipient(struct smtp_path *path);
+int drop_recipient(struct smtp_path *path);
+int define_envelope_sender(JSContext *cx, JSObject *session, struct smtp_path *path);
+int define_recipients(JSContext *cx, JSObject *session, struct list_head *fpath);
+int append_recipient(JSContext *cx, JSObject *session, struct smtp_path *path);
+int remove_recipient(JSContext *cx, JSObject *session, struct smtp_path *path);
 
 // Header class methods
 int add_body_stream(bfd_t *body_stream);
+bfd_t *js_smtp_client_stream(void);
+int set_mime_parts(struct list_head *parts);
 int add_header_properties(jsval *header, jsval *name, jsval *parts_recv);
 int add_part_to_header(jsval *header, char *c_str);
 jsval new_header_instance(char *name);
 
+// Headers class methods
+JSObject *new_headers_instance(JSContext *cx, struct headers_view *view);
+int set_headers(struct smtp_server_context *ctx);
+int sync_headers(void);
+
 /* Will be deleted */
 void js_dump_value(JSContext *cx, jsval v);
 void js_dump_response(JSContext *cx, jsval v);
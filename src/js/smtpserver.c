@@ -1,13 +1,21 @@
 #include "smtpserver.h"
 #include "../smtp.h"
 #include "../bfd.h"
+#include "../internet_message.h"
 #include "js.h"
 #include "string_tools.h"
+#include "../config.h"
+#include "../smtp_rules.h"
+#include "../smtp_client.h"
+#include "../smtp_server.h"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -29,7 +37,7 @@ jsval create_response(JSContext *cx, int code, const char* message, int disconne
 	JSObject *messages_arr;
 
 	if (message != NULL) {
-		js_message = STRING_TO_JSVAL(JS_InternString(cx, message));
+		js_message = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, message));
 	} else {
 		js_message = STRING_TO_JSVAL(JS_InternString(cx, "default err message"));
 	}
@@ -43,59 +51,106 @@ jsval create_response(JSContext *cx, int code, const char* message, int disconne
 	return response;
 }
 
-static JSBool smtpPath_construct(JSContext *cx, unsigned argc, jsval *vp) {
-	jsval path, smtpPath;
-	JSObject *domains, *mailbox, *smtpPath_obj;
+static JSBool smtpPath_defineString(JSContext *cx, JSObject *obj, const char *name, const char *value) {
+	JSString *str;
+
+	if (value == NULL || value == EMPTY_STRING) {
+		value = "";
+	}
 
-	path = JS_ARGV(cx, vp)[0];
+	if ((str = JS_NewStringCopyZ(cx, value)) == NULL) {
+		return JS_FALSE;
+	}
+
+	return JS_DefineProperty(cx, obj, name, STRING_TO_JSVAL(str), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT);
+}
 
-	char *c_str = JS_EncodeString(cx, JSVAL_TO_STRING(path));
-	char *trailing = c_str;
+/*
+ * Create a SmtpPath object from a native path. The object is a copy, so
+ * it stays valid after the native path is freed.
+ */
+static JSObject *new_smtp_path_view(JSContext *cx, struct smtp_path *path) {
+	struct smtp_domain *domain;
+	JSObject *domains, *mailbox, *smtpPath_obj;
+	JSString *str;
+	int i = 0;
 
-	smtpPath_obj = JS_NewObject(cx, 0, 0, 0);
+	if ((smtpPath_obj = JS_NewObject(cx, 0, 0, 0)) == NULL) {
+		return NULL;
+	}
 
 	// Add toString method
 	if (!JS_DefineFunction(cx, smtpPath_obj, "toString", smtpPath_toString, 0, 0)) {
-		return -1;
+		return NULL;
 	}
 
 	// Add domains property
-	domains = JS_NewArrayObject(cx, 0, NULL);
+	if ((domains = JS_NewArrayObject(cx, 0, NULL)) == NULL) {
+		return NULL;
+	}
 
-	if (!domains) {
-		return -1;
+	list_for_each_entry(domain, &path->domains, lh) {
+		if ((str = JS_NewStringCopyZ(cx, domain->domain)) == NULL) {
+			return NULL;
+		}
+
+		if (!JS_DefineElement(cx, domains, i++, STRING_TO_JSVAL(str), NULL, NULL, JSPROP_ENUMERATE)) {
+			return NULL;
+		}
 	}
 
 	if (!JS_DefineProperty(cx, smtpPath_obj, "domains", OBJECT_TO_JSVAL(domains), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
-		return -1;
+		return NULL;
 	}
 
 	// Add mailbox property
-	mailbox = JS_NewObject(cx, NULL, NULL, NULL);
-
-	if (!mailbox) {
-		return -1;
+	if ((mailbox = JS_NewObject(cx, NULL, NULL, NULL)) == NULL) {
+		return NULL;
 	}
 
-	if (!JS_DefineProperty(cx, mailbox, "local", STRING_TO_JSVAL(JS_InternString(cx, "")), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
-		return -1;
+	if (!smtpPath_defineString(cx, mailbox, "local", path->mailbox.local)) {
+		return NULL;
 	}
 
-	if (!JS_DefineProperty(cx, mailbox, "domain", STRING_TO_JSVAL(JS_InternString(cx, "")), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
-		return -1;
+	if (!smtpPath_defineString(cx, mailbox, "domain", path->mailbox.domain.domain)) {
+		return NULL;
 	}
 
 	if (!JS_DefineProperty(cx, smtpPath_obj, "mailbox", OBJECT_TO_JSVAL(mailbox), NULL, NULL, JSPROP_ENUMERATE | JSPROP_READONLY | JSPROP_PERMANENT)) {
-		return -1;
+		return NULL;
 	}
 
-	smtpPath = OBJECT_TO_JSVAL(smtpPath_obj);
+	return smtpPath_obj;
+}
+
+static JSBool smtpPath_construct(JSContext *cx, unsigned argc, jsval *vp) {
+	struct smtp_path path;
+	struct arena arena;
+	JSObject *smtpPath_obj;
+	char *c_str, *trailing;
+
+	if ((c_str = JS_EncodeString(cx, JS_ValueToString(cx, JS_ARGV(cx, vp)[0]))) == NULL) {
+		return JS_FALSE;
+	}
+
+	arena_init(&arena);
+	smtp_path_init(&path);
+
+	// Malformed paths give an empty SmtpPath, like they always did
+	if (smtp_path_parse(&path, c_str, &arena, &trailing)) {
+		smtp_path_init(&path);
+	}
 
-	smtp_path_parse(&smtpPath, c_str, &trailing);
+	smtpPath_obj = new_smtp_path_view(cx, &path);
 
+	arena_reset(&arena);
 	JS_free(cx, c_str);
 
-	JS_SET_RVAL(cx, vp, smtpPath);
+	if (smtpPath_obj == NULL) {
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL(cx, vp, OBJECT_TO_JSVAL(smtpPath_obj));
 	return JS_TRUE;
 }
 
@@ -180,7 +235,7 @@ static JSBool smtpPath_toString(JSContext *cx, unsigned argc, jsval *vp) {
 
 	strcat(c_str, "\0");
 
-	JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(JS_InternString(cx, c_str)));
+	JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(JS_NewStringCopyZ(cx, c_str)));
 
 	free(c_str);
 
@@ -207,6 +262,126 @@ int init_smtp_path_class(JSContext *cx, JSObject *global) {
 	return 0;
 }
 
+/*
+ * The envelope of the current transaction. The session properties that
+ * expose it are getters that build the SmtpPath objects on first access
+ * and then replace themselves with the result.
+ */
+static struct smtp_path *session_rpath;
+static struct list_head *session_fpath;
+static JSBool session_recipients_cached;
+
+// Objects of the session that describe the current transaction. They are
+// created once, rooted, and emptied between transactions instead of being
+// created again for every message.
+static JSObject *session_recipients, *session_headers, *session_mime_parts;
+
+static JSBool session_getEnvelopeSender(JSContext *cx, JSObject *obj, jsid id, jsval *vp) {
+	JSObject *path;
+
+	*vp = JSVAL_NULL;
+
+	if (session_rpath != NULL && session_rpath->mailbox.local != NULL) {
+		if ((path = new_smtp_path_view(cx, session_rpath)) == NULL) {
+			return JS_FALSE;
+		}
+		*vp = OBJECT_TO_JSVAL(path);
+	}
+
+	return JS_DefineProperty(cx, obj, "envelopeSender", *vp, NULL, NULL, JSPROP_ENUMERATE);
+}
+
+static JSBool session_getRecipients(JSContext *cx, JSObject *obj, jsid id, jsval *vp) {
+	JSObject *recipients = session_recipients, *path_obj;
+	struct smtp_path *path;
+	int i = 0;
+
+	*vp = OBJECT_TO_JSVAL(recipients);
+
+	if (session_fpath != NULL) {
+		list_for_each_entry(path, session_fpath, mailbox.domain.lh) {
+			if ((path_obj = new_smtp_path_view(cx, path)) == NULL) {
+				return JS_FALSE;
+			}
+
+			if (!JS_DefineElement(cx, recipients, i++, OBJECT_TO_JSVAL(path_obj), NULL, NULL, JSPROP_ENUMERATE)) {
+				return JS_FALSE;
+			}
+		}
+	}
+
+	if (!JS_DefineProperty(cx, obj, "recipients", *vp, NULL, NULL, JSPROP_ENUMERATE)) {
+		return JS_FALSE;
+	}
+
+	session_recipients_cached = JS_TRUE;
+	return JS_TRUE;
+}
+
+int define_envelope_sender(JSContext *cx, JSObject *session, struct smtp_path *path) {
+	session_rpath = path;
+
+	if (!JS_DefineProperty(cx, session, "envelopeSender", JSVAL_VOID, session_getEnvelopeSender, NULL, JSPROP_ENUMERATE | JSPROP_SHARED)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int define_recipients(JSContext *cx, JSObject *session, struct list_head *fpath) {
+	session_fpath = fpath;
+	session_recipients_cached = JS_FALSE;
+
+	if (!JS_SetArrayLength(cx, session_recipients, 0)) {
+		return -1;
+	}
+
+	if (!JS_DefineProperty(cx, session, "recipients", JSVAL_VOID, session_getRecipients, NULL, JSPROP_ENUMERATE | JSPROP_SHARED)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called after path was added to the native recipient list. Nothing needs
+ * to be done until scripts have looked at the recipients.
+ */
+int append_recipient(JSContext *cx, JSObject *session, struct smtp_path *path) {
+	JSObject *path_obj;
+	uint32_t arr_len;
+
+	if (!session_recipients_cached) {
+		return 0;
+	}
+
+	if (!JS_GetArrayLength(cx, session_recipients, &arr_len)) {
+		return -1;
+	}
+
+	if ((path_obj = new_smtp_path_view(cx, path)) == NULL) {
+		return -1;
+	}
+
+	if (!JS_DefineElement(cx, session_recipients, arr_len, OBJECT_TO_JSVAL(path_obj), NULL, NULL, JSPROP_ENUMERATE)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Called after path was removed from the native recipient list. The array
+ * is rebuilt from the list the next time scripts look at it.
+ */
+int remove_recipient(JSContext *cx, JSObject *session, struct smtp_path *path) {
+	if (!session_recipients_cached) {
+		return 0;
+	}
+
+	return define_recipients(cx, session, session_fpath);
+}
+
 static JSBool header_toString(JSContext *cx, unsigned argc, jsval *vp) {
 	jsval value, rval, hname, parts, part;
 	uint32_t parts_len;
@@ -403,7 +578,7 @@ static JSBool header_getValue(JSContext *cx, unsigned argc, jsval *vp) {
 
 	strcat(c_str, "\0");
 
-	JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(JS_InternString(cx, c_str)));
+	JS_SET_RVAL(cx, vp, STRING_TO_JSVAL(JS_NewStringCopyZ(cx, c_str)));
 
 	free(c_str);
 
@@ -465,6 +640,465 @@ int init_header_class(JSContext *cx, JSObject *global) {
 	return 0;
 }
 
+/*
+ * The Headers class is an array-like view of the native header list
+ * (struct im_header). Header objects are only created when a script
+ * actually touches them, so that parsing a message does not cost any
+ * JS calls.
+ */
+static JSBool headers_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp);
+static JSBool headers_enumerate(JSContext *cx, JSObject *obj);
+
+static JSClass headers_class = {
+	"Headers", JSCLASS_HAS_PRIVATE | JSCLASS_NEW_RESOLVE,
+	JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+	headers_enumerate, (JSResolveOp) headers_resolve, JS_ConvertStub, JS_FinalizeStub,
+	JSCLASS_NO_OPTIONAL_MEMBERS
+};
+
+static JSObject *headers_proto;
+
+/*
+ * Native side of a Headers object: the session context whose header list
+ * and hash index it shows, and the headers in message order for indexed
+ * access. The array is built on first use, once per transaction; the list
+ * does not change once it is bound, after DATA.
+ */
+struct headers_view {
+	struct smtp_server_context *ctx;
+	struct im_header **index;
+	int count;
+};
+
+static struct headers_view session_headers_view;
+
+static struct headers_view *headers_get_view(JSContext *cx, JSObject *obj) {
+	struct headers_view *view = JS_GetInstancePrivate(cx, obj, &headers_class, NULL);
+	struct im_header *hdr;
+	int n = 0;
+
+	if (view == NULL || view->ctx == NULL) {
+		return NULL;
+	}
+
+	if (view->index != NULL) {
+		return view;
+	}
+
+	list_for_each_entry(hdr, &view->ctx->hdrs, lh)
+		n++;
+
+	if ((view->index = malloc((n + 1) * sizeof(struct im_header *))) == NULL) {
+		return NULL;
+	}
+
+	view->count = 0;
+	list_for_each_entry(hdr, &view->ctx->hdrs, lh) {
+		hdr->index = view->count;
+		view->index[view->count++] = hdr;
+	}
+
+	return view;
+}
+
+static struct im_header *headers_nth(JSContext *cx, JSObject *obj, int n) {
+	struct headers_view *view = headers_get_view(cx, obj);
+
+	if (view == NULL || n < 0 || n >= view->count) {
+		return NULL;
+	}
+
+	return view->index[n];
+}
+
+static JSBool headers_add_part(JSContext *cx, JSObject *parts, int i, const char *s, size_t len) {
+	JSString *str = JS_NewStringCopyN(cx, s, len);
+
+	if (!str) {
+		return JS_FALSE;
+	}
+
+	return JS_DefineElement(cx, parts, i, STRING_TO_JSVAL(str), NULL, NULL, JSPROP_ENUMERATE);
+}
+
+/*
+ * Create a Header object from a native header. Parts are split at the
+ * folding offsets, just like they were received.
+ */
+static JSBool headers_materialize(JSContext *cx, struct im_header *hdr, jsval *rval) {
+	struct im_header_folding *fold;
+	const char *value = hdr->value ? hdr->value : "";
+	JSObject *parts;
+	JSString *name;
+	jsval argv[2];
+	size_t prev = 0;
+	int i = 0;
+
+	if ((parts = JS_NewArrayObject(cx, 0, NULL)) == NULL) {
+		return JS_FALSE;
+	}
+
+	list_for_each_entry(fold, &hdr->folding, lh) {
+		if (!headers_add_part(cx, parts, i++, value + prev, fold->offset - prev)) {
+			return JS_FALSE;
+		}
+		prev = fold->offset;
+	}
+
+	if (!headers_add_part(cx, parts, i, value + prev, strlen(value + prev))) {
+		return JS_FALSE;
+	}
+
+	if ((name = JS_NewStringCopyZ(cx, hdr->name)) == NULL) {
+		return JS_FALSE;
+	}
+
+	argv[0] = STRING_TO_JSVAL(name);
+	argv[1] = OBJECT_TO_JSVAL(parts);
+
+	return js_new_header(argv, rval);
+}
+
+static JSBool headers_resolve(JSContext *cx, JSObject *obj, jsid id, uintN flags, JSObject **objp) {
+	struct im_header *hdr;
+	jsval header;
+
+	if (!JSID_IS_INT(id) || (hdr = headers_nth(cx, obj, JSID_TO_INT(id))) == NULL) {
+		return JS_TRUE;
+	}
+
+	if (!headers_materialize(cx, hdr, &header)) {
+		return JS_FALSE;
+	}
+
+	if (!JS_DefineElement(cx, obj, JSID_TO_INT(id), header, NULL, NULL, JSPROP_ENUMERATE)) {
+		return JS_FALSE;
+	}
+
+	*objp = obj;
+	return JS_TRUE;
+}
+
+static JSBool headers_enumerate(JSContext *cx, JSObject *obj) {
+	jsval header;
+	int i;
+
+	// Enumeration needs all elements, so resolve them now
+	for (i = 0; headers_nth(cx, obj, i) != NULL; i++) {
+		if (!JS_GetElement(cx, obj, i, &header)) {
+			return JS_FALSE;
+		}
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool headers_getLength(JSContext *cx, JSObject *obj, jsid id, jsval *vp) {
+	struct headers_view *view = headers_get_view(cx, obj);
+
+	*vp = INT_TO_JSVAL(view != NULL ? view->count : 0);
+	return JS_TRUE;
+}
+
+/*
+ * headers.get(name): first header with the given name (case insensitive),
+ * or null. The header is looked up in the hash index of the session and
+ * only that header is turned into a JS object.
+ */
+static JSBool headers_get(JSContext *cx, unsigned argc, jsval *vp) {
+	JSObject *obj = JS_THIS_OBJECT(cx, vp);
+	struct headers_view *view = headers_get_view(cx, obj);
+	struct im_header *hdr;
+	jsval rval = JSVAL_NULL;
+	JSString *str;
+	char *name;
+
+	if (argc < 1 || view == NULL) {
+		JS_SET_RVAL(cx, vp, rval);
+		return JS_TRUE;
+	}
+
+	if ((str = JS_ValueToString(cx, JS_ARGV(cx, vp)[0])) == NULL) {
+		return JS_FALSE;
+	}
+
+	if ((name = JS_EncodeString(cx, str)) == NULL) {
+		return JS_FALSE;
+	}
+
+	hdr = im_header_find(view->ctx, name);
+	JS_free(cx, name);
+
+	// The element is resolved through its index, so that get() and
+	// indexed access return the same object
+	if (hdr != NULL && hdr->index >= 0 && hdr->index < view->count && view->index[hdr->index] == hdr) {
+		if (!JS_GetElement(cx, obj, hdr->index, &rval)) {
+			return JS_FALSE;
+		}
+	}
+
+	JS_SET_RVAL(cx, vp, rval);
+	return JS_TRUE;
+}
+
+/*
+ * Native form of a Header object. The value is the concatenation of the
+ * parts, folded at the start of each part but the first, which is where
+ * headers_materialize() splits it. Folding replaces the character at the
+ * offset with the line break, so a part that does not start with
+ * whitespace gets a space in front.
+ */
+static struct im_header *headers_unmaterialize(JSContext *cx, JSObject *header, struct arena *arena) {
+	struct string_buffer sb;
+	struct im_header *hdr = NULL;
+	jsval hname, parts, part;
+	uint32_t parts_len, i;
+	JSString *str;
+	char *s, *p;
+
+	if (!JS_GetProperty(cx, header, "hname", &hname) || !JS_GetProperty(cx, header, "parts", &parts)) {
+		return NULL;
+	}
+
+	if (JSVAL_IS_PRIMITIVE(parts) || !JS_GetArrayLength(cx, JSVAL_TO_OBJECT(parts), &parts_len)) {
+		JS_ReportError(cx, "Header parts must be an array");
+		return NULL;
+	}
+
+	if ((str = JS_ValueToString(cx, hname)) == NULL || (s = JS_EncodeString(cx, str)) == NULL) {
+		return NULL;
+	}
+
+	hdr = im_header_alloc(arena, s);
+	JS_free(cx, s);
+	if (hdr == NULL) {
+		JS_ReportOutOfMemory(cx);
+		return NULL;
+	}
+
+	string_buffer_init(&sb);
+	for (i = 0; i < parts_len; i++) {
+		if (!JS_GetElement(cx, JSVAL_TO_OBJECT(parts), i, &part) ||
+				(str = JS_ValueToString(cx, part)) == NULL ||
+				(s = JS_EncodeString(cx, str)) == NULL) {
+			goto out_err;
+		}
+
+		// The value starts after "name: "
+		p = i ? s : s + strspn(s, " \t");
+		if (i && im_header_add_fold(hdr, sb.cur) == NULL) {
+			JS_free(cx, s);
+			goto out_oom;
+		}
+		if (i && *p != ' ' && *p != '\t' && string_buffer_append_char(&sb, ' ')) {
+			JS_free(cx, s);
+			goto out_oom;
+		}
+		if (string_buffer_append_string(&sb, p)) {
+			JS_free(cx, s);
+			goto out_oom;
+		}
+		JS_free(cx, s);
+	}
+
+	if ((hdr->value = arena_strndup(arena, sb.s ? sb.s : "", sb.cur)) == NULL) {
+		goto out_oom;
+	}
+
+	string_buffer_cleanup(&sb);
+	return hdr;
+
+out_oom:
+	JS_ReportOutOfMemory(cx);
+out_err:
+	string_buffer_cleanup(&sb);
+	return NULL;
+}
+
+static int headers_equal(struct im_header *a, struct im_header *b) {
+	struct list_head *fa, *fb;
+
+	if (strcmp(a->name, b->name) || strcmp(a->value ? a->value : "", b->value ? b->value : "")) {
+		return 0;
+	}
+
+	for (fa = a->folding.next, fb = b->folding.next; fa != &a->folding && fb != &b->folding;
+			fa = fa->next, fb = fb->next) {
+		if (list_entry(fa, struct im_header_folding, lh)->offset !=
+				list_entry(fb, struct im_header_folding, lh)->offset) {
+			return 0;
+		}
+	}
+
+	return fa == &a->folding && fb == &b->folding;
+}
+
+/*
+ * Header objects are detached copies of the native headers, which are
+ * what gets serialized. Write the changes that scripts made back to the
+ * native list: modified names or parts, headers set to null (removed)
+ * and headers assigned past the end (appended). Headers whose objects
+ * still match keep their original bytes.
+ */
+static JSBool headers_sync(JSContext *cx, JSObject *obj) {
+	struct headers_view *view = headers_get_view(cx, obj);
+	struct smtp_server_context *ctx;
+	struct im_header *hdr, *tmp, **index;
+	struct im_header_folding *fold;
+	struct list_head *pos;
+	JSBool found;
+	jsval header;
+	int i;
+
+	if (view == NULL) {
+		return JS_TRUE;
+	}
+	ctx = view->ctx;
+
+	for (i = 0; ; i++) {
+		// Only the elements that scripts touched are own properties
+		if (!JS_AlreadyHasOwnElement(cx, obj, i, &found)) {
+			return JS_FALSE;
+		}
+
+		if (!found) {
+			if (i >= view->count) {
+				break;
+			}
+			continue;
+		}
+
+		if (!JS_GetElement(cx, obj, i, &header)) {
+			return JS_FALSE;
+		}
+
+		hdr = i < view->count ? view->index[i] : NULL;
+
+		// Removed, unless it already was by a previous sync
+		if (JSVAL_IS_PRIMITIVE(header)) {
+			if (hdr != NULL && hdr->lh.next != NULL) {
+				im_header_remove(hdr);
+			}
+			continue;
+		}
+
+		if ((tmp = headers_unmaterialize(cx, JSVAL_TO_OBJECT(header), &ctx->arena)) == NULL) {
+			return JS_FALSE;
+		}
+
+		// Appended; keep it in the view, so that it is added only once
+		if (hdr == NULL) {
+			if ((index = realloc(view->index, (view->count + 2) * sizeof(struct im_header *))) == NULL) {
+				JS_ReportOutOfMemory(cx);
+				return JS_FALSE;
+			}
+			view->index = index;
+			tmp->index = view->count;
+			view->index[view->count++] = tmp;
+			im_header_insert(&ctx->hdrs, ctx->hdrs_hash, tmp, &ctx->hdrs);
+			continue;
+		}
+
+		if (hdr->lh.next == NULL || headers_equal(hdr, tmp)) {
+			continue;
+		}
+
+		// The hash index is ordered, so a renamed header is inserted
+		// again at the same position
+		if (strcmp(hdr->name, tmp->name)) {
+			pos = hdr->lh.next;
+			im_header_remove(hdr);
+			hdr->name = tmp->name;
+			hdr->hash = tmp->hash;
+			im_header_insert(&ctx->hdrs, ctx->hdrs_hash, hdr, pos);
+		}
+
+		hdr->value = tmp->value;
+		im_header_unfold(hdr);
+		list_for_each_entry(fold, &tmp->folding, lh) {
+			if (im_header_add_fold(hdr, fold->offset) == NULL) {
+				JS_ReportOutOfMemory(cx);
+				return JS_FALSE;
+			}
+		}
+	}
+
+	return JS_TRUE;
+}
+
+/*
+ * Apply the changes that scripts made to session.headers, before the
+ * native headers are relayed.
+ */
+int sync_session_headers(JSContext *cx) {
+	return headers_sync(cx, session_headers) ? 0 : -1;
+}
+
+int init_headers_class(JSContext *cx, JSObject *global) {
+	static JSPropertySpec headers_props[] = {
+		{"length", 0, JSPROP_READONLY | JSPROP_PERMANENT | JSPROP_SHARED, headers_getLength, NULL},
+		{0, 0, 0, 0, 0}
+	};
+
+	static JSFunctionSpec headers_methods[] = {
+		JS_FS("get", headers_get, 1, 0),
+		JS_FS_END
+	};
+
+	// Instances are only created natively, so there is no constructor
+	headers_proto = JS_InitClass(cx, global, NULL, &headers_class, NULL, 0, headers_props, headers_methods, NULL, NULL);
+
+	if (!headers_proto) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create a Headers object for the given view. The view must stay valid
+ * for as long as the object is reachable from scripts.
+ */
+JSObject *new_headers_instance(JSContext *cx, struct headers_view *view) {
+	JSObject *headers;
+
+	headers = JS_NewObject(cx, &headers_class, headers_proto, NULL);
+
+	if (!headers) {
+		return NULL;
+	}
+
+	if (!JS_SetPrivate(cx, headers, view)) {
+		return NULL;
+	}
+
+	return headers;
+}
+
+/*
+ * Bind the session Headers object to the headers of another context, or
+ * to no headers if ctx is NULL. The header objects resolved from the
+ * previous list are dropped.
+ */
+JSObject *reset_session_headers(JSContext *cx, struct smtp_server_context *ctx) {
+	JS_ClearScope(cx, session_headers);
+
+	free(session_headers_view.index);
+	session_headers_view.index = NULL;
+	session_headers_view.count = 0;
+	session_headers_view.ctx = ctx;
+
+	return session_headers;
+}
+
+JSObject *reset_session_mime_parts(JSContext *cx) {
+	if (!JS_SetArrayLength(cx, session_mime_parts, 0)) {
+		return NULL;
+	}
+
+	return session_mime_parts;
+}
+
 static JSBool response_construct(JSContext *cx, unsigned argc, jsval *vp) {
 	jsval code, messages, disconnect;
 	jsval response;
@@ -624,14 +1258,13 @@ static JSBool smtpClient_connect(JSContext *cx, unsigned argc, jsval *vp) {
 static JSBool smtpClient_readResponse(JSContext *cx, unsigned argc, jsval *vp) {
 	jsval smtpClient, connection, content, response, clientStream;
 	jsval js_code, js_messages, js_disconnect;
-	JSObject *messages_obj, *global;
+	JSObject *messages_obj;
 
 	int code, lines_count;
 	char buf[SMTP_COMMAND_MAX + 1], *p, sep;
 	ssize_t sz;
 	bfd_t *client_stream;
 
-	global = JS_GetGlobalForScopeChain(cx);
 	smtpClient = JS_THIS(cx, vp);
 	messages_obj = JS_NewArrayObject(cx, 0, 0);
 
@@ -669,7 +1302,7 @@ static JSBool smtpClient_readResponse(JSContext *cx, unsigned argc, jsval *vp) {
 			buf[--sz] = '\0';
 
 		//add response
-		content = STRING_TO_JSVAL(JS_InternString(cx, buf + 4));
+		content = STRING_TO_JSVAL(JS_NewStringCopyN(cx, buf + 4, sz > 4 ? sz - 4 : 0));
 		if (!JS_SetElement(cx, messages_obj, lines_count++, &content)) {
 			return -1;
 		}
@@ -680,8 +1313,7 @@ static JSBool smtpClient_readResponse(JSContext *cx, unsigned argc, jsval *vp) {
 	js_disconnect = JSVAL_FALSE;
 	jsval argv[] = {js_code, js_messages, js_disconnect};
 
-	JS_CallFunctionName(cx, global, "SmtpResponse",
-				3, argv, &response);
+	response = js_create_response(argv);
 
 	JS_SET_RVAL(cx, vp, response);
 	return JS_TRUE;
@@ -747,107 +1379,106 @@ out_err:
 	return JS_FALSE;
 }
 
+// smtpClient.sendMessageBody([headers[, path]]): send the message to the
+// upstream server, after its DATA command was accepted. The headers are
+// a Headers object (session.headers by default) and are serialized
+// natively, including the changes made to its Header objects; the body is streamed from the given file or the spool file of
+// the transaction, dot-stuffed and followed by the termination marker.
 static JSBool smtpClient_sendMessageBody(JSContext *cx, unsigned argc, jsval *vp) {
-	jsval headers, path, smtpClient, connection, rval, clientStream;
-	char *c_path, *c_header;
-	int sockfd, n, i, bodyfd;
-	uint32_t headers_len;
-	FILE *fp;
+	jsval headers = JSVAL_NULL, path = JSVAL_NULL, smtpClient, clientStream, bodyStream;
+	JSObject *headers_obj = session_headers;
+	struct headers_view *view;
+	struct list_head *hdrs;
 	bfd_t *client_stream, *body_stream;
+	char *c_path;
+	int fd = -1, err;
 
-	headers = JS_ARGV(cx, vp)[0];
-	path = JS_ARGV(cx, vp)[1];
-	smtpClient = JS_THIS(cx, vp);
-
-	// If no path, then use the default path where the body was saved
-	if (argc == 1 || JSVAL_IS_NULL(path)) {
-		jsval bodyStream;
+	if (argc > 0) {
+		headers = JS_ARGV(cx, vp)[0];
+	}
 
-		if (!JS_GetProperty(cx, JSVAL_TO_OBJECT(smtpClient), "bodyStream", &bodyStream)) {
-			return JS_FALSE;
-		}
+	if (argc > 1) {
+		path = JS_ARGV(cx, vp)[1];
+	}
 
-		body_stream = JSVAL_TO_PRIVATE(bodyStream);
-	} else {
-		c_path = JS_EncodeString(cx, JSVAL_TO_STRING(path));
-		fp = fopen(c_path, "r");
+	smtpClient = JS_THIS(cx, vp);
 
-		if (!fp) {
-			JS_ReportError(js_context, "The file %s cannot be opened!", c_path);
-			free(c_path);
+	if (!JSVAL_IS_NULL(headers) && !JSVAL_IS_VOID(headers)) {
+		if (JSVAL_IS_PRIMITIVE(headers)) {
+			JS_ReportError(cx, "sendMessageBody: headers must be a Headers object");
 			return JS_FALSE;
 		}
+		headers_obj = JSVAL_TO_OBJECT(headers);
+	}
 
-		bodyfd = fileno(fp);
-
-		if (bodyfd < 0) {
-			JS_ReportError(js_context, "The file %s cannot be opened!", c_path);
-			free(c_path);
-			return JS_FALSE;
-		}
+	if (!JS_InstanceOf(cx, headers_obj, &headers_class, NULL)) {
+		JS_ReportError(cx, "sendMessageBody: headers must be a Headers object");
+		return JS_FALSE;
+	}
+	view = JS_GetPrivate(cx, headers_obj);
+	hdrs = view != NULL && view->ctx != NULL ? &view->ctx->hdrs : NULL;
 
-		free(c_path);
-		body_stream = bfd_alloc(bodyfd);
+	if (hdrs != NULL && !headers_sync(cx, headers_obj)) {
+		return JS_FALSE;
 	}
 
 	if (!JS_GetProperty(cx, JSVAL_TO_OBJECT(smtpClient), "clientStream", &clientStream)) {
 		return JS_FALSE;
 	}
 
-	client_stream = JSVAL_TO_PRIVATE(clientStream);
-
-	// Get number of headers
-	if (!JS_GetArrayLength(cx, JSVAL_TO_OBJECT(headers), &headers_len)) {
+	if (JSVAL_IS_VOID(clientStream) || JSVAL_IS_NULL(clientStream)) {
+		JS_ReportError(cx, "sendMessageBody: not connected");
 		return JS_FALSE;
 	}
+	client_stream = JSVAL_TO_PRIVATE(clientStream);
 
-	// Send headers
-	for (i = 0; i < (int) headers_len; i++) {
-		if (!JS_GetElement(cx, JSVAL_TO_OBJECT(headers), i, &rval)) {
-			return -1;
+	// If no path, then use the spool file where the body was saved
+	if (JSVAL_IS_NULL(path) || JSVAL_IS_VOID(path)) {
+		if (!JS_GetProperty(cx, JSVAL_TO_OBJECT(smtpClient), "bodyStream", &bodyStream)) {
+			return JS_FALSE;
 		}
 
-		jsval header;
-		JS_CallFunctionName(cx, JSVAL_TO_OBJECT(rval), "toString",
-				0, NULL, &header);
-
-		c_header = JS_EncodeString(cx, JSVAL_TO_STRING(header));
-
-		if (bfd_puts(client_stream, c_header) < 0) {
-			free(c_header);
-			bfd_close(client_stream);
+		if (JSVAL_IS_VOID(bodyStream) || JSVAL_IS_NULL(bodyStream)) {
+			JS_ReportError(cx, "sendMessageBody: no message body");
+			return JS_FALSE;
+		}
+		body_stream = JSVAL_TO_PRIVATE(bodyStream);
+	} else {
+		if (!JSVAL_IS_STRING(path) || !(c_path = JS_EncodeString(cx, JSVAL_TO_STRING(path)))) {
 			return JS_FALSE;
 		}
 
-
-		if (bfd_puts(client_stream, "\r\n") < 0) {
-			free(c_header);
-			bfd_close(client_stream);
+		fd = open(c_path, O_RDONLY);
+		if (fd < 0) {
+			JS_ReportError(cx, "The file %s cannot be opened!", c_path);
+			JS_free(cx, c_path);
 			return JS_FALSE;
 		}
+		JS_free(cx, c_path);
 
-		free(c_header);
+		body_stream = bfd_alloc(fd);
+		if (!body_stream) {
+			close(fd);
+			JS_ReportOutOfMemory(cx);
+			return JS_FALSE;
+		}
 	}
 
-	if (bfd_puts(client_stream, "\r\n") < 0) {
-		bfd_close(client_stream);
-		return JS_FALSE;
-	}
+	err = (hdrs != NULL && im_header_write(hdrs, client_stream)) ||
+		bfd_puts(client_stream, "\r\n") < 0 ||
+		smtp_send_file(client_stream, body_stream) ||
+		bfd_flush(client_stream) < 0;
 
-	// Put message body in the buffer
-	if (bfd_puts(client_stream, body_stream->wb) < 0) {
-		return JS_FALSE;
+	if (fd >= 0) {
+		bfd_close(body_stream);
 	}
 
-	if (bfd_puts(client_stream, "\r\n.\r\n") < 0) {
-		bfd_close(client_stream);
+	if (err) {
+		JS_ReportError(cx, "sendMessageBody: could not send the message");
 		return JS_FALSE;
 	}
 
-
-	// Flush message body
-	bfd_flush(client_stream);
-
+	JS_SET_RVAL(cx, vp, JSVAL_VOID);
 	return JS_TRUE;
 }
 
@@ -920,16 +1551,355 @@ int init_smtp_client_class(JSContext *cx, JSObject *global) {
 	return 0;
 }
 
+// Commands whose handlers scripts can define, as smtpServer.smtpXxxx
+static const char *js_hdlr_cmds[] = {
+	"INIT", "AUTH", "ALOU", "ALOP", "APLP", "EHLO", "HELO",
+	"DATA", "MAIL", "RCPT", "RSET", "QUIT", "BODY", "CLNP"
+};
+
+// Handler dispatch table, indexed by the js_hdlr_hash slot of the command.
+// The function values are rooted and kept current by the smtpServer class
+// hooks below, so dispatching a command needs no property lookup.
+static struct smtp_cmd_hash js_hdlr_hash;
+static struct {
+	char name[9];
+	jsval fn;
+	// Number of times the handler was aborted by the watchdog
+	unsigned int overruns;
+} js_hdlrs[SMTP_CMD_HASH_SIZE];
+
+static JSObject *js_smtp_server;
+
+// Return the js_hdlrs slot of the handler named by id, or -1
+static int js_hdlr_slot(JSContext *cx, jsid id) {
+	jsval idval;
+	char *name;
+	int slot = -1;
+
+	if (!JS_IdToValue(cx, id, &idval) || !JSVAL_IS_STRING(idval)) {
+		return -1;
+	}
+
+	if (JS_GetStringLength(JSVAL_TO_STRING(idval)) != 8) {
+		return -1;
+	}
+
+	name = JS_EncodeString(cx, JSVAL_TO_STRING(idval));
+	if (!name) {
+		return -1;
+	}
+
+	if (!strncmp(name, "smtp", 4)) {
+		slot = smtp_cmd_hash_lookup(&js_hdlr_hash, name + 4);
+		if (slot >= 0 && strcmp(name, js_hdlrs[slot].name)) {
+			slot = -1;
+		}
+	}
+
+	JS_free(cx, name);
+	return slot;
+}
+
+static JSBool smtpserver_setProperty(JSContext *cx, JSObject *obj, jsid id, JSBool strict, jsval *vp) {
+	int slot = js_hdlr_slot(cx, id);
+
+	js_invalidate_handles(cx, id);
+
+	if (slot >= 0) {
+		js_hdlrs[slot].fn = *vp;
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool smtpserver_delProperty(JSContext *cx, JSObject *obj, jsid id, jsval *vp) {
+	int slot = js_hdlr_slot(cx, id);
+
+	js_invalidate_handles(cx, id);
+
+	if (slot >= 0) {
+		js_hdlrs[slot].fn = JSVAL_VOID;
+	}
+
+	return JS_TRUE;
+}
+
+static int init_js_hdlrs(JSContext *cx, JSObject *smtpServer) {
+	int i, slot, n = sizeof(js_hdlr_cmds) / sizeof(js_hdlr_cmds[0]);
+	const char *cmd;
+
+	if (smtp_cmd_hash_init(&js_hdlr_hash, js_hdlr_cmds, n)) {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		cmd = js_hdlr_cmds[i];
+		slot = smtp_cmd_hash_lookup(&js_hdlr_hash, cmd);
+		sprintf(js_hdlrs[slot].name, "smtp%c%c%c%c", cmd[0],
+				tolower((unsigned char)cmd[1]), tolower((unsigned char)cmd[2]),
+				tolower((unsigned char)cmd[3]));
+		js_hdlrs[slot].fn = JSVAL_VOID;
+		if (!JS_AddNamedValueRoot(cx, &js_hdlrs[slot].fn, js_hdlrs[slot].name)) {
+			return -1;
+		}
+	}
+
+	js_smtp_server = smtpServer;
+	if (!JS_AddNamedObjectRoot(cx, &js_smtp_server, "smtpServer")) {
+		return -1;
+	}
+
+	return js_smtp_server_resolve_hdlrs(cx);
+}
+
+// Look up all the handlers. Called once the configuration script has run;
+// the class hooks take care of later changes.
+int js_smtp_server_resolve_hdlrs(JSContext *cx) {
+	int slot;
+
+	for (slot = 0; slot < SMTP_CMD_HASH_SIZE; slot++) {
+		if (!js_hdlrs[slot].name[0]) {
+			continue;
+		}
+
+		if (!JS_GetProperty(cx, js_smtp_server, js_hdlrs[slot].name, &js_hdlrs[slot].fn)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Pass a string, or each string of an array, to add()
+static int compile_rule_list(JSContext *cx, JSObject *obj, const char *name, unsigned int n,
+		struct smtp_rule *rule, int (*add)(struct smtp_rule *, const char *)) {
+	jsval v, elem;
+	uint32_t len = 1, i;
+	char *str;
+	int err;
+
+	if (!JS_GetProperty(cx, obj, name, &v)) {
+		return -1;
+	}
+
+	if (JSVAL_IS_VOID(v)) {
+		return 0;
+	}
+
+	if (!JSVAL_IS_STRING(v) && (JSVAL_IS_PRIMITIVE(v) ||
+			!JS_IsArrayObject(cx, JSVAL_TO_OBJECT(v)) ||
+			!JS_GetArrayLength(cx, JSVAL_TO_OBJECT(v), &len))) {
+		fprintf(stderr, "%s: ERROR: rule %u: '%s' must be a string or an array of strings\n",
+				__func__, n, name);
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		elem = v;
+		if (!JSVAL_IS_STRING(v) && !JS_GetElement(cx, JSVAL_TO_OBJECT(v), i, &elem)) {
+			return -1;
+		}
+
+		if (!JSVAL_IS_STRING(elem) || !(str = JS_EncodeString(cx, JSVAL_TO_STRING(elem)))) {
+			fprintf(stderr, "%s: ERROR: rule %u: '%s' must be a string or an array of strings\n",
+					__func__, n, name);
+			return -1;
+		}
+
+		if ((err = add(rule, str))) {
+			fprintf(stderr, "%s: ERROR: rule %u: invalid %s '%s'\n",
+					__func__, n, name, str);
+		}
+		JS_free(cx, str);
+
+		if (err) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Compile smtpServer.rules into the decision table that is tried before
+// the handlers. Every rule is an object such as
+//	{ command: "RCPT", domain: ["example.com", ".example.com"],
+//	  client: "10.0.0.0/8", action: "relay" }
+//	{ command: "MAIL", code: 550, message: "Go away", disconnect: true }
+int js_smtp_server_compile_rules(JSContext *cx) {
+	jsval rules, v;
+	JSObject *rules_arr, *obj;
+	uint32_t len, i;
+	struct smtp_rule *rule;
+	const char *err;
+	char *str;
+	jsdouble code;
+	JSBool disconnect;
+
+	if (!JS_GetProperty(cx, js_smtp_server, "rules", &rules)) {
+		return -1;
+	}
+
+	if (JSVAL_IS_VOID(rules)) {
+		return 0;
+	}
+
+	if (JSVAL_IS_PRIMITIVE(rules) || !JS_IsArrayObject(cx, JSVAL_TO_OBJECT(rules))) {
+		fprintf(stderr, "%s: ERROR: 'smtpServer.rules' must be an array\n", __func__);
+		return -1;
+	}
+	rules_arr = JSVAL_TO_OBJECT(rules);
+
+	if (!JS_GetArrayLength(cx, rules_arr, &len)) {
+		return -1;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (!JS_GetElement(cx, rules_arr, i, &v)) {
+			return -1;
+		}
+
+		if (JSVAL_IS_PRIMITIVE(v)) {
+			fprintf(stderr, "%s: ERROR: rule %u is not an object\n", __func__, i);
+			return -1;
+		}
+		obj = JSVAL_TO_OBJECT(v);
+
+		// Command
+		if (!JS_GetProperty(cx, obj, "command", &v)) {
+			return -1;
+		}
+
+		if (!JSVAL_IS_STRING(v) || !(str = JS_EncodeString(cx, JSVAL_TO_STRING(v)))) {
+			fprintf(stderr, "%s: ERROR: rule %u has no command\n", __func__, i);
+			return -1;
+		}
+
+		rule = smtp_rule_add(str);
+		if (!rule) {
+			fprintf(stderr, "%s: ERROR: rule %u: rules are not supported for '%s'\n",
+					__func__, i, str);
+		}
+		JS_free(cx, str);
+
+		if (!rule) {
+			return -1;
+		}
+
+		// Conditions
+		if (compile_rule_list(cx, obj, "domain", i, rule, smtp_rule_add_domain) ||
+				compile_rule_list(cx, obj, "client", i, rule, smtp_rule_add_client)) {
+			return -1;
+		}
+
+		// Decision
+		if (!JS_GetProperty(cx, obj, "action", &v)) {
+			return -1;
+		}
+
+		if (!JSVAL_IS_VOID(v)) {
+			if (!JSVAL_IS_STRING(v) || !(str = JS_EncodeString(cx, JSVAL_TO_STRING(v)))) {
+				return -1;
+			}
+
+			if (!strcmp(str, "relay")) {
+				rule->action = SMTP_RULE_RELAY;
+			} else if (strcmp(str, "reply")) {
+				fprintf(stderr, "%s: ERROR: rule %u: unknown action '%s'\n",
+						__func__, i, str);
+				JS_free(cx, str);
+				return -1;
+			}
+			JS_free(cx, str);
+		}
+
+		if (!JS_GetProperty(cx, obj, "code", &v)) {
+			return -1;
+		}
+
+		if (!JSVAL_IS_VOID(v)) {
+			if (!JSVAL_IS_NUMBER(v) || !JS_ValueToNumber(cx, v, &code)) {
+				fprintf(stderr, "%s: ERROR: rule %u: 'code' must be a number\n", __func__, i);
+				return -1;
+			}
+			rule->code = (int)code;
+		}
+
+		if (!JS_GetProperty(cx, obj, "message", &v)) {
+			return -1;
+		}
+
+		if (!JSVAL_IS_VOID(v)) {
+			if (!JSVAL_IS_STRING(v) || !(str = JS_EncodeString(cx, JSVAL_TO_STRING(v)))) {
+				fprintf(stderr, "%s: ERROR: rule %u: 'message' must be a string\n", __func__, i);
+				return -1;
+			}
+			rule->message = strdup(str);
+			JS_free(cx, str);
+		}
+
+		if (!JS_GetProperty(cx, obj, "disconnect", &v) ||
+				!JS_ValueToBoolean(cx, v, &disconnect)) {
+			return -1;
+		}
+		rule->disconnect = disconnect;
+
+		if ((err = smtp_rule_commit(rule))) {
+			fprintf(stderr, "%s: ERROR: rule %u: %s\n", __func__, i, err);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Call the smtpServer handler of the given command. A handler that runs
+// out of CPU time is aborted and replaced by the engine.watchdog response.
+jsval js_smtp_server_call(const char *cmd, unsigned argc, jsval *argv) {
+	int slot = smtp_cmd_hash_lookup(&js_hdlr_hash, cmd);
+	jsval rval, response[3];
+	JSBool ok;
+	int expired;
+
+	if (slot < 0 || JSVAL_IS_VOID(js_hdlrs[slot].fn)) {
+		fprintf(stderr, "%s: ERROR: no handler defined for '%s'\n",
+				__func__, cmd);
+		return JSVAL_NULL;
+	}
+
+	js_watchdog_start();
+	ok = JS_CallFunctionValue(js_context, js_smtp_server, js_hdlrs[slot].fn, argc, argv, &rval);
+	expired = js_watchdog_stop();
+
+	if (!ok && expired) {
+		js_hdlrs[slot].overruns++;
+		fprintf(stderr, "%s: ERROR: 'smtpServer.%s()' exceeded its CPU time budget (%u times)\n",
+				__func__, js_hdlrs[slot].name, js_hdlrs[slot].overruns);
+
+		response[0] = INT_TO_JSVAL(config.js_timeout_code);
+		response[1] = STRING_TO_JSVAL(JS_NewStringCopyZ(js_context, config.js_timeout_message));
+		response[2] = JSVAL_FALSE;
+		return js_create_response(response);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "%s: ERROR: failed calling 'smtpServer.%s()'\n",
+				__func__, js_hdlrs[slot].name);
+		return JSVAL_NULL;
+	}
+
+	return rval;
+}
+
 int js_smtp_server_obj_init(JSContext *cx, JSObject *global)
 {
 	static JSClass smtpserver_class = {
-		"smtpServer", 0, JS_PropertyStub, JS_PropertyStub,
-		JS_PropertyStub, JS_StrictPropertyStub, JS_EnumerateStub,
+		"smtpServer", 0, JS_PropertyStub, smtpserver_delProperty,
+		JS_PropertyStub, smtpserver_setProperty, JS_EnumerateStub,
 		JS_ResolveStub, JS_ConvertStub, JS_PropertyStub,
 		JSCLASS_NO_OPTIONAL_MEMBERS
 	};
 
-	JSObject *smtpServer, *session, *recipients, *headers;
+	JSObject *smtpServer, *session, *headers;
 
 	smtpServer = JS_DefineObject(cx, global, "smtpServer", &smtpserver_class, NULL, 0);
 	if (!smtpServer)
@@ -955,6 +1925,10 @@ int js_smtp_server_obj_init(JSContext *cx, JSObject *global)
 		return -1;
 	}
 
+	if (init_js_hdlrs(cx, smtpServer)) {
+		return -1;
+	}
+
 	session = JS_NewObject(cx, NULL, NULL, NULL);
 
 	// Define and set session properties
@@ -962,29 +1936,43 @@ int js_smtp_server_obj_init(JSContext *cx, JSObject *global)
 		return -1;
 	}
 
-	if (JS_DefineProperty(cx, session, "envelopeSender", JSVAL_NULL, NULL, NULL, JSPROP_ENUMERATE) == JS_FALSE) {
+	// Pooled transaction objects
+	if ((session_recipients = JS_NewArrayObject(cx, 0, NULL)) == NULL ||
+			!JS_AddNamedObjectRoot(cx, &session_recipients, "session.recipients")) {
 		return -1;
 	}
 
-	// Add domains property
-	recipients = JS_NewArrayObject(cx, 0, NULL);
+	if ((session_mime_parts = JS_NewArrayObject(cx, 0, NULL)) == NULL ||
+			!JS_AddNamedObjectRoot(cx, &session_mime_parts, "session.mimeParts")) {
+		return -1;
+	}
+
+	// Envelope properties; bound to the native paths by js_session_reset()
+	if (define_envelope_sender(cx, session, NULL)) {
+		return -1;
+	}
 
-	if (!recipients) {
+	if (define_recipients(cx, session, NULL)) {
 		return -1;
 	}
 
-	if (!JS_DefineProperty(cx, session, "recipients", OBJECT_TO_JSVAL(recipients), NULL, NULL, JSPROP_ENUMERATE | JSPROP_PERMANENT)) {
+	// Add headers property; the list is bound to it after DATA
+	if (init_headers_class(cx, global)) {
 		return -1;
 	}
 
-	// Add headers property
-	headers = JS_NewArrayObject(cx, 0, NULL);
+	headers = new_headers_instance(cx, &session_headers_view);
 
 	if (!headers) {
 		return -1;
 	}
 
-	if (!JS_DefineProperty(cx, session, "headers", OBJECT_TO_JSVAL(headers), NULL, NULL, JSPROP_ENUMERATE | JSPROP_PERMANENT)) {
+	session_headers = headers;
+	if (!JS_AddNamedObjectRoot(cx, &session_headers, "session.headers")) {
+		return -1;
+	}
+
+	if (!JS_DefineProperty(cx, session, "headers", OBJECT_TO_JSVAL(headers), NULL, NULL, JSPROP_ENUMERATE)) {
 		return -1;
 	}
 
@@ -1,5 +1,5 @@
-#ifndef _SMTP_SERVER_H
-#define _SMTP_SERVER_H
+#ifndef _JS_SMTPSERVER_H
+#define _JS_SMTPSERVER_H
 
 #include "js.h"
 
@@ -21,6 +21,11 @@ static JSBool header_getValue(JSContext *cx, unsigned argc, jsval *vp);
 static JSBool header_toString(JSContext *cx, unsigned argc, jsval *vp);
 static JSBool header_refold(JSContext *cx, unsigned argc, jsval *vp);
 
+// Headers class methods
+int init_headers_class(JSContext *cx, JSObject *global);
+static JSBool headers_get(JSContext *cx, unsigned argc, jsval *vp);
+static JSBool headers_getLength(JSContext *cx, JSObject *obj, jsid id, jsval *vp);
+
 // SmtpClient class methods
 int init_smtp_client_class(JSContext *cx, JSObject *global);
 static int connect_to_address(char *ip, char *port);
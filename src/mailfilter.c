@@ -103,6 +103,8 @@ static void show_help(const char *argv0)
 			"  -c <path>       Read configuration file from <path>\n"
 			"  -d              Do not fork to background; log everything to stderr\n"
 			"  -h              Show this help\n"
+			"  -x <path>       Cache the compiled configuration in <path>\n"
+			"                  (default: configuration file path + \".xdr\")\n"
 			"\n",
 			argv0);
 }
@@ -294,7 +296,7 @@ int main(int argc, char **argv)
 		.sa_flags = SA_SIGINFO | SA_NOCLDSTOP
 	};
 
-	while ((opt = getopt(argc, argv, "hdc:")) != -1) {
+	while ((opt = getopt(argc, argv, "hdc:x:")) != -1) {
 		switch (opt) {
 		case 'c':
 			config.path = strdup(optarg);
@@ -302,6 +304,9 @@ int main(int argc, char **argv)
 		case 'd':
 			config.daemon = 0;
 			break;
+		case 'x':
+			config.script_cache = strdup(optarg);
+			break;
 		case 'h':
 			show_help(argv[0]);
 			return 0;
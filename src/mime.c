@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "mime.h"
+#include "internet_message.h"
+
+static const char *tab_space = "\t ";
+
+void mime_part_free(struct mime_part *part)
+{
+	free(part->type);
+	free(part->encoding);
+	free(part->filename);
+	free(part);
+}
+
+/**
+ * Extract the value of parameter @name from a structured header value
+ * such as Content-Type or Content-Disposition. Quoted strings are
+ * unquoted. Returns a newly allocated string, or NULL if the parameter
+ * is not present.
+ */
+char *mime_param(const char *value, const char *name)
+{
+	struct string_buffer sb = STRING_BUFFER_INITIALIZER;
+	size_t len = strlen(name);
+	const char *p = value, *q;
+
+	while (*p != '\0') {
+		/* skip to the next parameter, ignoring quoted strings */
+		if (*p == '"') {
+			for (p++; *p != '\0' && *p != '"'; p++)
+				if (*p == '\\' && p[1] != '\0')
+					p++;
+			if (*p != '\0')
+				p++;
+			continue;
+		}
+		if (*p++ != ';')
+			continue;
+
+		p += strspn(p, tab_space);
+		if (strncasecmp(p, name, len))
+			continue;
+		q = p + len;
+		q += strspn(q, tab_space);
+		if (*q++ != '=')
+			continue;
+		q += strspn(q, tab_space);
+
+		if (*q != '"')
+			return strndup(q, strcspn(q, "\t ;"));
+
+		for (q++; *q != '\0' && *q != '"'; q++) {
+			if (*q == '\\' && q[1] != '\0')
+				q++;
+			if (string_buffer_append_char(&sb, *q)) {
+				string_buffer_cleanup(&sb);
+				return NULL;
+			}
+		}
+		return sb.s != NULL ? string_buffer_detach(&sb) : strdup("");
+	}
+
+	return NULL;
+}
+
+/**
+ * Copy the first token of a header value (up to the first ';'), without
+ * surrounding whitespace and converted to lowercase.
+ */
+static char *mime_token(const char *value)
+{
+	size_t len;
+	char *ret, *p;
+
+	value += strspn(value, tab_space);
+	for (len = strcspn(value, ";"); len && strchr(tab_space, value[len - 1]); len--);
+
+	if ((ret = strndup(value, len)) == NULL)
+		return NULL;
+	for (p = ret; *p != '\0'; p++)
+		*p = tolower(*p);
+
+	return ret;
+}
+
+static void mime_header_value(struct mime_context *ctx, const char *name, const char *value)
+{
+	struct mime_part *part = ctx->part;
+	char *filename;
+
+	if (!strcasecmp(name, "Content-Type")) {
+		free(part->type);
+		part->type = mime_token(value);
+		free(ctx->next_boundary);
+		ctx->next_boundary = mime_param(value, "boundary");
+		/* "name" is obsolete, but still used by many mailers; the
+		 * Content-Disposition filename takes precedence */
+		if (part->filename == NULL)
+			part->filename = mime_param(value, "name");
+		return;
+	}
+
+	if (!strcasecmp(name, "Content-Transfer-Encoding")) {
+		free(part->encoding);
+		part->encoding = mime_token(value);
+		return;
+	}
+
+	if (!strcasecmp(name, "Content-Disposition")) {
+		if ((filename = mime_param(value, "filename")) == NULL)
+			return;
+		free(part->filename);
+		part->filename = filename;
+		return;
+	}
+}
+
+/**
+ * Process the (unfolded) part header accumulated in ctx->hdr.
+ */
+static void mime_header(struct mime_context *ctx)
+{
+	char *value;
+
+	if (!ctx->hdr.cur)
+		return;
+
+	if ((value = strchr(ctx->hdr.s, ':')) != NULL) {
+		*(value++) = '\0';
+		ctx->hdr.s[strcspn(ctx->hdr.s, tab_space)] = '\0';
+		mime_header_value(ctx, ctx->hdr.s, value);
+	}
+
+	string_buffer_reset(&ctx->hdr);
+}
+
+static struct mime_part *mime_part_alloc(struct mime_context *ctx, int depth)
+{
+	struct mime_part *part = malloc(sizeof(struct mime_part));
+
+	if (part == NULL)
+		return NULL;
+
+	part->depth = depth;
+	part->hdr_start = ctx->offset;
+	part->body_start = -1;
+	part->body_end = -1;
+	part->type = NULL;
+	part->encoding = NULL;
+	part->filename = NULL;
+	list_add_tail(&part->lh, ctx->parts);
+
+	return part;
+}
+
+/**
+ * Called at the end of the current part headers. If the part is itself
+ * a multipart entity, its boundary becomes the innermost one.
+ */
+static void mime_body(struct mime_context *ctx)
+{
+	struct mime_part *part = ctx->part;
+
+	part->body_start = ctx->offset;
+	if (part->type == NULL)
+		part->type = strdup("text/plain");
+	if (part->encoding == NULL)
+		part->encoding = strdup("7bit");
+
+	ctx->state = MIME_S_BODY;
+	if (!mime_part_is_multipart(part) || ctx->next_boundary == NULL ||
+			ctx->depth >= MIME_MAX_DEPTH)
+		return;
+
+	ctx->container[ctx->depth] = part;
+	ctx->boundary[ctx->depth++] = ctx->next_boundary;
+	ctx->next_boundary = NULL;
+	ctx->part = NULL;
+	ctx->state = MIME_S_PREAMBLE;
+}
+
+/**
+ * Close the current leaf part at offset @end.
+ */
+static void mime_close(struct mime_context *ctx, off_t end)
+{
+	struct mime_part *part = ctx->part;
+
+	if (part == NULL)
+		return;
+
+	if (ctx->state == MIME_S_HEADERS) {
+		/* headers not terminated by an empty line: no body */
+		mime_header(ctx);
+		part->body_start = end;
+	}
+	part->body_end = end < part->body_start ? part->body_start : end;
+	ctx->part = NULL;
+}
+
+/**
+ * Pop open multipart entities down to @depth, ending them at @end.
+ */
+static void mime_pop(struct mime_context *ctx, int depth, off_t end)
+{
+	while (ctx->depth > depth) {
+		ctx->depth--;
+		ctx->container[ctx->depth]->body_end = end;
+		free(ctx->boundary[ctx->depth]);
+	}
+}
+
+static void mime_boundary(struct mime_context *ctx, int level, int closing)
+{
+	/* the line break before the delimiter belongs to the delimiter */
+	off_t end = ctx->line_start - ctx->prev_eol;
+
+	mime_close(ctx, end);
+	free(ctx->next_boundary);
+	ctx->next_boundary = NULL;
+
+	if (closing) {
+		mime_pop(ctx, level + 1, end);
+		mime_pop(ctx, level, ctx->offset);
+		/* epilogue, ignored until the next outer delimiter */
+		ctx->state = MIME_S_PREAMBLE;
+		return;
+	}
+
+	mime_pop(ctx, level + 1, end);
+	if ((ctx->part = mime_part_alloc(ctx, level + 1)) == NULL) {
+		ctx->state = MIME_S_PREAMBLE;
+		return;
+	}
+	ctx->state = MIME_S_HEADERS;
+}
+
+static void mime_line(struct mime_context *ctx)
+{
+	size_t len = ctx->len, blen;
+	char *line = ctx->line;
+	int i;
+
+	/* strip the line terminator */
+	if (len && line[len - 1] == '\n')
+		len--;
+	if (len && line[len - 1] == '\r')
+		len--;
+	line[len] = '\0';
+
+	/* look for a delimiter of any open multipart entity; a delimiter of an
+	 * outer entity implicitly closes the inner ones (RFC 2046, 5.1.2) */
+	if (ctx->depth && len >= 2 && line[0] == '-' && line[1] == '-') {
+		for (i = ctx->depth - 1; i >= 0; i--) {
+			blen = strlen(ctx->boundary[i]);
+			if (len < blen + 2 || memcmp(line + 2, ctx->boundary[i], blen))
+				continue;
+			if (!strncmp(line + 2 + blen, "--", 2)) {
+				mime_boundary(ctx, i, 1);
+				return;
+			}
+			/* transport padding is allowed after the delimiter */
+			if (line[2 + blen + strspn(line + 2 + blen, tab_space)] == '\0') {
+				mime_boundary(ctx, i, 0);
+				return;
+			}
+		}
+	}
+
+	if (ctx->state != MIME_S_HEADERS)
+		return;
+
+	if (!len) {
+		mime_header(ctx);
+		mime_body(ctx);
+		return;
+	}
+
+	if (!strchr(tab_space, line[0]))
+		mime_header(ctx);
+	if (ctx->hdr.cur + len < MIME_HDR_MAX)
+		string_buffer_append_string(&ctx->hdr, line);
+}
+
+/**
+ * Start indexing the message body. @hdrs are the top-level message
+ * headers, which determine the structure of the body.
+ */
+int mime_start(struct mime_context *ctx, struct list_head *hdrs)
+{
+	struct im_header *hdr;
+
+	if ((ctx->part = mime_part_alloc(ctx, 0)) == NULL)
+		return -ENOMEM;
+
+	list_for_each_entry(hdr, hdrs, lh) {
+		if (hdr->name != NULL && hdr->value != NULL)
+			mime_header_value(ctx, hdr->name, hdr->value);
+	}
+
+	mime_body(ctx);
+	return 0;
+}
+
+void mime_feed(struct mime_context *ctx, char c)
+{
+	ctx->offset++;
+
+	if (ctx->state == MIME_S_IDLE)
+		return;
+
+	/* we only care about the beginning of long lines */
+	if (ctx->len < MIME_LINE_MAX)
+		ctx->line[ctx->len++] = c;
+
+	if (c != '\n') {
+		ctx->last = c;
+		return;
+	}
+
+	mime_line(ctx);
+	ctx->prev_eol = ctx->last == '\r' ? 2 : 1;
+	ctx->line_start = ctx->offset;
+	ctx->len = 0;
+	ctx->last = c;
+}
+
+/**
+ * End of the message body: close all parts that are still open.
+ */
+void mime_finish(struct mime_context *ctx)
+{
+	if (ctx->state == MIME_S_IDLE)
+		return;
+
+	mime_close(ctx, ctx->offset);
+	mime_pop(ctx, 0, ctx->offset);
+	ctx->state = MIME_S_IDLE;
+}
+
+void mime_context_cleanup(struct mime_context *ctx)
+{
+	mime_finish(ctx);
+	free(ctx->next_boundary);
+	ctx->next_boundary = NULL;
+	string_buffer_cleanup(&ctx->hdr);
+}
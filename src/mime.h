@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MIME_H
+#define _MIME_H
+
+/* Streaming parser that indexes the MIME structure (RFC 2045, RFC 2046)
+ * of a message body while it is being spooled */
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "list.h"
+#include "string_tools.h"
+
+/* Maximum nesting level of multipart entities that we track */
+#define MIME_MAX_DEPTH 8
+
+/* Maximum line length (RFC 5322) plus <CR><LF> */
+#define MIME_LINE_MAX 1000
+
+/* Maximum size of a (possibly folded) part header */
+#define MIME_HDR_MAX 4096
+
+/**
+ * A single MIME entity. Offsets are relative to the start of the spooled
+ * message body (i.e. after the top-level headers).
+ */
+struct mime_part {
+	struct list_head lh;
+	/* Nesting level; 0 is the message itself */
+	int depth;
+	/* Offset of the part headers; 0 for the message itself */
+	off_t hdr_start;
+	/* Part body (for multipart entities, this includes all sub-parts) */
+	off_t body_start, body_end;
+	/* Lowercase type/subtype, without parameters */
+	char *type;
+	/* Lowercase Content-Transfer-Encoding */
+	char *encoding;
+	/* From Content-Disposition or Content-Type; NULL if not specified */
+	char *filename;
+};
+
+/**
+ * Context for the MIME structure parser.
+ */
+struct mime_context {
+	enum {
+		MIME_S_IDLE,
+		MIME_S_HEADERS,
+		MIME_S_BODY,
+		MIME_S_PREAMBLE
+	} state;
+	/* List of struct mime_part, in the order they start */
+	struct list_head *parts;
+	/* Part whose headers or body are currently being parsed */
+	struct mime_part *part;
+	/* Open multipart entities and their boundaries */
+	struct mime_part *container[MIME_MAX_DEPTH];
+	char *boundary[MIME_MAX_DEPTH];
+	char *next_boundary;
+	int depth;
+	/* Current offset, start of current line, line break length of the
+	 * previous line */
+	off_t offset, line_start;
+	int prev_eol;
+	char last;
+	char line[MIME_LINE_MAX + 1];
+	size_t len;
+	struct string_buffer hdr;
+};
+
+#define MIME_CONTEXT_INITIALIZER {\
+	.state = MIME_S_IDLE,\
+	.parts = NULL,\
+	.part = NULL,\
+	.next_boundary = NULL,\
+	.depth = 0,\
+	.offset = 0,\
+	.line_start = 0,\
+	.prev_eol = 0,\
+	.last = '\0',\
+	.len = 0,\
+	.hdr = STRING_BUFFER_INITIALIZER\
+}
+
+int mime_start(struct mime_context *ctx, struct list_head *hdrs);
+void mime_feed(struct mime_context *ctx, char c);
+void mime_finish(struct mime_context *ctx);
+void mime_context_cleanup(struct mime_context *ctx);
+void mime_part_free(struct mime_part *part);
+char *mime_param(const char *value, const char *name);
+
+static inline int mime_part_is_multipart(struct mime_part *part)
+{
+	return part->type != NULL && !strncmp(part->type, "multipart/", 10);
+}
+
+#endif
@@ -33,9 +33,11 @@
 #include "smtp_server.h"
 #include "string_tools.h"
 
-static uint64_t key;
 static const char *module = "clamav";
 
+void mod_clamav_init(void);
+SMTP_MODULE(mod_clamav_module, "clamav", mod_clamav_init);
+
 #include "pexec.h"
 
 int mod_clamav_send_headers(struct smtp_server_context *ctx, bfd_t *fw)
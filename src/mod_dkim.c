@@ -25,6 +25,8 @@
 
 #include "mod_dkim.h"
 
+SMTP_MODULE(mod_dkim_module, "dkim", mod_dkim_init);
+
 #define DKIM_MAXHOSTNAMELEN	256
 #define MAXPACKET		8192
 #define BUFRSZ			1024
@@ -168,13 +170,13 @@ static int mod_dkim_hdlr_body(struct smtp_server_context *ctx, const char *cmd,
 {
 	struct im_header *hdr;
 
-	hdr = im_header_find(ctx, "dkim-signature");
-	if (!hdr)
-		return 0;
-
-	printf("DKIM-Signature header found!\n");
-	mod_dkim_parse_signature(hdr->value);
-	mod_dkim_dns_get_key();
+	/* a message may carry several signatures (e.g. added by
+	 * mailing lists); check all of them */
+	im_header_for_each(hdr, ctx, "dkim-signature") {
+		printf("DKIM-Signature header found!\n");
+		mod_dkim_parse_signature(hdr->value);
+		mod_dkim_dns_get_key();
+	}
 
 	return 0;
 }
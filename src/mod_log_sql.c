@@ -30,7 +30,6 @@
 #include <string.h>
 #include <unistd.h>
 
-static uint64_t key;
 static const char *module = "log_sql";
 
 enum {
@@ -62,9 +61,11 @@ static const char *prepared_statements[] = {
 #include "smtp_client.h"
 #include "pgsql_tools.h"
 
+SMTP_MODULE(mod_log_sql_module, "log_sql", mod_log_sql_init);
+
 int mod_log_sql_new_transaction(struct smtp_server_context *ctx)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 	PGresult *res;
 	char remote_port[6];
 	char *remote[] = {
@@ -92,7 +93,7 @@ int mod_log_sql_new_transaction(struct smtp_server_context *ctx)
 
 int mod_log_sql_end_transaction(struct smtp_server_context *ctx)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 	uint64_t my_transaction_id = priv->smtp_transaction_id;
 	char id[20], code[10];
 	const char * params[4] = {
@@ -128,8 +129,7 @@ int mod_log_sql_hdlr_init(struct smtp_server_context *ctx, const char *cmd, cons
 	assert_mod_log(priv != NULL);
 	memset(priv, 0, sizeof(struct mod_log_sql_priv));
 
-	if (smtp_priv_register(ctx, key, priv) < 0)
-		goto out_err;
+	smtp_priv_register(ctx, &mod_log_sql_module, priv);
 
 	mod_log(LOG_DEBUG, "Using connect string %s\n", ctx->cfg->dbconn);
 
@@ -150,14 +150,14 @@ int mod_log_sql_hdlr_init(struct smtp_server_context *ctx, const char *cmd, cons
 out_err:
 	if (priv->conn != NULL)
 		PQfinish(priv->conn);
-	smtp_priv_unregister(ctx, key);
+	smtp_priv_unregister(ctx, &mod_log_sql_module);
 	free(priv);
 	return 0;
 }
 
 int mod_log_sql_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 	char id[20];
 	char *params[2] = {
 		smtp_path_to_string(&ctx->rpath),
@@ -179,7 +179,7 @@ int mod_log_sql_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, cons
 
 int mod_log_sql_hdlr_rcpt(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 	char id[20];
 	char *params[2] = {&id[0], NULL};
 	PGresult *res;
@@ -223,13 +223,13 @@ int mod_log_sql_hdlr_rset(struct smtp_server_context *ctx, const char *cmd, cons
 
 int mod_log_sql_hdlr_term(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 
 	mod_log_sql_end_transaction(ctx);
 
 	PQfinish(priv->conn);
 
-	smtp_priv_unregister(ctx, key);
+	smtp_priv_unregister(ctx, &mod_log_sql_module);
 	free(priv);
 
 	return 0;
@@ -237,7 +237,7 @@ int mod_log_sql_hdlr_term(struct smtp_server_context *ctx, const char *cmd, cons
 
 int mod_log_sql_hdlr_body(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_log_sql_priv *priv = smtp_priv_lookup(ctx, &mod_log_sql_module);
 	char id[20], size[20];
 	char * params[2] = {
 		&size[0],
@@ -264,10 +264,7 @@ int mod_log_sql_hdlr_body(struct smtp_server_context *ctx, const char *cmd, cons
 	return 0;
 }
 
-/* void __attribute__((constructor)) my_init() */
-
 void mod_log_sql_init(void)
 {
-	key = smtp_priv_key(module);
 }
 
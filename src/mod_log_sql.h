@@ -31,4 +31,6 @@ struct mod_log_sql_priv {
 	uint64_t smtp_transaction_id;
 };
 
+void mod_log_sql_init(void);
+
 #endif
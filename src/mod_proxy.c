@@ -32,11 +32,25 @@
 
 #include "mod_proxy.h"
 #include "smtp_client.h"
-#include "base64.h"
 
-static uint64_t key;
 static const char *module = "proxy";
 
+/*
+ * The commands are relayed only after the local policy (smtpServer.rules,
+ * the JS handlers and the other modules) accepted them; the upstream
+ * response then replaces the local one.
+ */
+static const struct smtp_module_hook mod_proxy_hooks[] = {
+	{ "MAIL", mod_proxy_hdlr_mail, SMTP_HOOK_ACCEPTED },
+	{ "RCPT", mod_proxy_hdlr_rcpt, SMTP_HOOK_ACCEPTED },
+	{ "DATA", mod_proxy_hdlr_body, SMTP_HOOK_ACCEPTED },
+	{ "RSET", mod_proxy_hdlr_rset, SMTP_HOOK_ACCEPTED },
+	{ "CLNP", mod_proxy_hdlr_term, 0 },
+	{ NULL, NULL, 0 }
+};
+
+SMTP_MODULE_EXT(mod_proxy_module, "proxy", mod_proxy_init, mod_proxy_hooks, NULL);
+
 static const char *proxy_host = "127.0.0.1";
 static const int proxy_port = 25;
 
@@ -44,25 +58,62 @@ int copy_response_callback(int code, const char *message, int last, void *priv)
 {
 	struct smtp_server_context *ctx = priv;
 
+	free(ctx->message);
 	ctx->code = code;
 	ctx->message = strdup(message);
 
 	return 0;
 }
 
-int mod_proxy_hdlr_init(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+int deferred_response_callback(int code, const char *message, int last, void *priv)
 {
-	struct mod_proxy_priv *priv;
-	int sock, err, ret = 0;
+	struct smtp_deferred *d = priv;
+
+	free(d->message);
+	d->code = code;
+	d->message = strdup(message);
+
+	return 0;
+}
+
+/*
+ * Read the upstream response to a pipelined command. Commands are queued
+ * in the upstream stream and sent in one write when the first response
+ * is needed.
+ */
+int mod_proxy_resolve(struct smtp_server_context *ctx, struct smtp_deferred *d)
+{
+	struct mod_proxy_priv *priv = d->priv;
+
+	if (bfd_flush(priv->sock) < 0)
+		return -1;
+
+	return smtp_client_response(priv->sock, deferred_response_callback, d) < 0 ? -1 : 0;
+}
+
+/*
+ * Connect to the upstream server and introduce ourselves on behalf of
+ * the client. This is deferred until the first command that has to be
+ * relayed, so that connections which never start a transaction cost us
+ * neither an upstream connection nor its buffers. Returns NULL if the
+ * upstream server is not available.
+ */
+static struct mod_proxy_priv *mod_proxy_connect(struct smtp_server_context *ctx)
+{
+	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, &mod_proxy_module);
+	char buf[SMTP_COMMAND_MAX + 1];
 	struct sockaddr_in peer;
+	ssize_t sz;
+	int sock, err;
+
+	if (priv != NULL)
+		return priv;
 
 	priv = malloc(sizeof(struct mod_proxy_priv));
-	assert_mod_log(priv != NULL);
+	if (priv == NULL)
+		return NULL;
 	memset(priv, 0, sizeof(struct mod_proxy_priv));
 
-	if (smtp_priv_register(ctx, key, priv) < 0)
-		goto out_err;
-
 	sock = socket(PF_INET, SOCK_STREAM, 0);
 	if (sock == -1)
 		goto out_err;
@@ -85,222 +136,106 @@ int mod_proxy_hdlr_init(struct smtp_server_context *ctx, const char *cmd, const
 		mod_log(LOG_ERR, "error %d reading initial greeting\n", err);
 		goto out_err;
 	}
+	free(ctx->message);
+	ctx->message = NULL;
+	if (ctx->code < 200 || ctx->code > 299)
+		goto out_err;
 
-	return 0;
-out_err:
-	if (sock != -1)
-		close(sock);
-	smtp_priv_unregister(ctx, key);
-	free(priv);
-	return ret;
-}
-
-int mod_proxy_hdlr_helo(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
-{
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-	char *domain;
-
-	assert_mod_log(priv);
-
-	/* We must break the rules and modify arg to strip the terminating newline. Otherwise
-	 * the server to which we're proxying gets confused, since it expects the \r\n line
-	 * ending. smtp_client_command already appends this.
-	 */
-	domain = (char *)arg;
-	domain[strcspn(domain, "\r\n")] = '\0';
-	smtp_client_command(priv->sock, cmd, domain);
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
-}
-
-int mod_proxy_hdlr_ehlo(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
-{
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-	char buf[SMTP_COMMAND_MAX + 1], sep;
-	struct string_buffer sb = STRING_BUFFER_INITIALIZER;
-	ssize_t sz;
-
-	assert_mod_log(priv);
-
-	/* send the EHLO command to the real SMTP server */
-	smtp_client_command(priv->sock, cmd, ctx->identity);
-	/* read the real SMTP server response */
+	/* The client already got our own EHLO response; we only need to
+	 * know whether the upstream server supports pipelining */
+	if (smtp_client_command(priv->sock, "EHLO", ctx->identity ? ctx->identity : "localhost"))
+		goto out_err;
 	do {
 		if ((sz = bfd_read_line(priv->sock, buf, SMTP_COMMAND_MAX)) <= 0)
 			goto out_err;
 		buf[sz] = '\0';
-		if (strlen(buf) < 4)
+		if (strlen(buf) < 4 || buf[0] != '2')
 			goto out_err;
-		if ((sep = buf[3]) != '-')
-			break;
 		buf[strcspn(buf, "\r\n")] = '\0';
-		if (string_buffer_append_string(&sb, &buf[4]))
-			goto out_err;
-		if (string_buffer_append_char(&sb, '\n'))
-			goto out_err;
-	} while (1);
+		if (!strcasecmp(&buf[4], "PIPELINING"))
+			priv->pipelining = 1;
+	} while (buf[3] == '-');
 
-	buf[strcspn(buf, "\r\n")] = '\0';
-	buf[3] = '\0';
-	ctx->code = strtol(buf, NULL, 10);
-	if (string_buffer_append_string(&sb, &buf[4]))
-		goto out_err;
-	ctx->message = sb.s;
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
+	smtp_priv_register(ctx, &mod_proxy_module, priv);
+	return priv;
 
 out_err:
-	string_buffer_cleanup(&sb);
-	return 0;
-}
-
-int mod_proxy_auth_send_one(struct smtp_server_context *ctx, const char *cmd) {
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-	char buf[SMTP_COMMAND_MAX + 1], sep;
-	ssize_t sz;
-
-	assert_mod_log(priv);
-
-	/* Send command to the real stmp server */
-	if (smtp_client_command(priv->sock, cmd, NULL))
-		return 0;
-
-	/* read back the smtp server response */
-	if ((sz = bfd_read_line(priv->sock, buf, SMTP_COMMAND_MAX)) < 0)
-		return 0;
-	buf[sz] = '\0';
-
-	if (strlen(buf) < 4)
-		return 0;
-
-	/* parse the response code */
-	sep = buf[3];
-	buf[3] = '\0';
-	ctx->code = strtol(buf, NULL, 10);
-	buf[3] = sep;
-
-	if (ctx->code != 334) {
-		buf[strcspn(buf, "\r\n")] = '\0';
-		ctx->message = strdup(&buf[4]);
-		return 0;
-	}
-
-	return 0;
+	if (priv->sock != NULL)
+		bfd_close(priv->sock);
+	else if (sock != -1)
+		close(sock);
+	free(priv);
+	ctx->code = 0;
+	return NULL;
 }
 
-int mod_proxy_hdlr_alop(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+/*
+ * Answer the command ourselves when it cannot be relayed. Leaving the code
+ * to 0 would keep the local response, which accepted the command.
+ */
+static int mod_proxy_unavailable(struct smtp_server_context *ctx)
 {
-	char buf[SMTP_COMMAND_MAX + 1], *user64, *pw64;
-	int err;
-
-	/* AUTH LOGIN base64(username) */
-	user64 = base64_enc(ctx->auth_user, strlen(ctx->auth_user));
-	if (!user64)
-		return 0;
-
-	err = sprintf(buf, "AUTH LOGIN %s", user64);
-	assert_mod_log(err < SMTP_COMMAND_MAX + 1);
-	free(user64);
-
-	err = mod_proxy_auth_send_one(ctx, buf);
-	if (err != 0)
-		return err;
-
-	/* base64(password) */
-	pw64 = base64_enc(ctx->auth_pw, strlen(ctx->auth_pw));
-	if (!pw64)
-		return 0;
-
-	err = mod_proxy_auth_send_one(ctx, pw64);
-	free(pw64);
-	if (err != 0)
-		return err;
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
+	free(ctx->message);
+	ctx->code = 451;
+	ctx->message = strdup("Upstream server not available");
+	return 0;
 }
 
-int mod_proxy_hdlr_aplp(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+/*
+ * Send an envelope command upstream. If the upstream server supports
+ * pipelining, the response is deferred until the client has no more
+ * commands in flight.
+ */
+int mod_proxy_path_cmd(struct smtp_server_context *ctx, const char *cmd, struct smtp_path *path,
+		const char *params, bfd_t *stream)
 {
-	char buf[SMTP_COMMAND_MAX + 1], *auth64;
-	int err;
-
-	/* FIXME: should we brutally abort, or gracefully signal an internal server error? */
-	assert_mod_log(ctx->auth_user);
-	assert_mod_log(ctx->auth_pw);
-	assert_mod_log(2 + strlen(ctx->auth_user) + strlen(ctx->auth_pw) < SMTP_COMMAND_MAX + 1);
+	struct mod_proxy_priv *priv = mod_proxy_connect(ctx);
 
-	memset(buf, 0, sizeof(buf));
-	memcpy(&buf[1], ctx->auth_user, strlen(ctx->auth_user));
-	memcpy(&buf[2 + strlen(ctx->auth_user)], ctx->auth_pw, strlen(ctx->auth_pw));
+	if (priv == NULL || smtp_put_path_cmd(priv->sock, cmd, path, params))
+		return mod_proxy_unavailable(ctx);
 
-	/* AUTH PLAIN base64(buf) */
-	auth64 = base64_enc(buf, 2 + strlen(ctx->auth_user) + strlen(ctx->auth_pw));
-	if (!auth64)
+	if (priv->pipelining && smtp_server_defer(ctx, mod_proxy_resolve, priv) != NULL)
 		return 0;
 
-	err = sprintf(buf, "AUTH PLAIN %s", auth64);
-	assert_mod_log(err < SMTP_COMMAND_MAX + 1);
-	free(auth64);
+	/* responses to previously pipelined commands come first */
+	smtp_server_resolve(ctx, stream);
+	if (bfd_flush(priv->sock) < 0 || smtp_client_response(priv->sock, copy_response_callback, ctx) < 0)
+		return mod_proxy_unavailable(ctx);
 
-	err = mod_proxy_auth_send_one(ctx, buf);
-	if (err != 0)
-		return err;
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
-}
-
-int mod_proxy_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
-{
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-
-	smtp_c_mail(priv->sock, &ctx->rpath);
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
+	return 0;
 }
 
-int mod_proxy_hdlr_rcpt(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+int mod_proxy_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream)
 {
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-
-	if (list_empty(&ctx->fpath))
-		return 0;
-
-	smtp_c_rcpt(priv->sock, list_entry(ctx->fpath.prev, struct smtp_path, mailbox.domain.lh));
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
+	return mod_proxy_path_cmd(ctx, "MAIL FROM", path, arg, stream);
 }
 
-int mod_proxy_hdlr_quit(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+int mod_proxy_hdlr_rcpt(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream)
 {
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
-
-	smtp_client_command(priv->sock, "QUIT", NULL);
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
-
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
+	return mod_proxy_path_cmd(ctx, "RCPT TO", path, arg, stream);
 }
 
-int mod_proxy_hdlr_body(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+int mod_proxy_hdlr_body(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream)
 {
-	/* We have no handler for DATA. Instead, we use this handler to send
-	 * both stages (DATA and message body) to the origin server.
+	/* This runs once the whole message was received and accepted by
+	 * the local policy, so that antivirus and other checks of the
+	 * message body can still reject it.
 	 *
 	 * Once we send "DATA" to the origin server, there is no way to
-	 * cancel message delivery. But it is only in the BODY stage that we
-	 * know for sure if the message can be delivered (for instance the
-	 * message can be rejected by antivir modules upon message body
-	 * inspection).
-	 *
-	 * So we don't send anything to the origin server in the DATA stage,
-	 * and then we send both stages when we reach the BODY stage.
+	 * cancel message delivery, so we send both stages (DATA and message
+	 * body) at this point.
 	 */
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, &mod_proxy_module);
 
-	smtp_client_command(priv->sock, "DATA", NULL);
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
+	smtp_server_resolve(ctx, stream);
+	if (priv == NULL)
+		goto out_err;
+	if (smtp_client_command(priv->sock, "DATA", NULL) ||
+			smtp_client_response(priv->sock, copy_response_callback, ctx) < 0)
+		goto out_err;
 
 	if (ctx->code < 300 || ctx->code > 399) {
 		return 0;
@@ -316,43 +251,59 @@ int mod_proxy_hdlr_body(struct smtp_server_context *ctx, const char *cmd, const
 	if (bfd_puts(priv->sock, "\r\n") < 0)
 		goto out_err;
 
-	bfd_seek(ctx->body.stream, 0, SEEK_SET);
-	if (smtp_copy_from_file(priv->sock, ctx->body.stream))
+	if (smtp_send_file(priv->sock, ctx->body.stream))
 		goto out_err;
 	bfd_flush(priv->sock);
 
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
-out_err:
-	/* leave code to 0 (fall back to the default Internal Server
-	 * Error message); update transaction state just to set the module */
+	if (smtp_client_response(priv->sock, copy_response_callback, ctx) < 0)
+		goto out_err;
 	return 0;
+out_err:
+	/* the message must not be accepted if the upstream server did not
+	 * take it */
+	return mod_proxy_unavailable(ctx);
 }
 
-int mod_proxy_hdlr_term(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+/*
+ * End of the session, possibly after a broken client connection: say
+ * goodbye to the upstream server and release the connection.
+ */
+int mod_proxy_hdlr_term(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream)
 {
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, &mod_proxy_module);
 
-	smtp_priv_unregister(ctx, key);
+	if (priv == NULL)
+		return 0;
+
+	if (!smtp_client_command(priv->sock, "QUIT", NULL))
+		smtp_client_response(priv->sock, NULL, NULL);
+
+	smtp_priv_unregister(ctx, &mod_proxy_module);
+	bfd_close(priv->sock);
 	free(priv);
 
 	return 0;
 }
 
-int mod_proxy_hdlr_rset(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+int mod_proxy_hdlr_rset(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream)
 {
-	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, key);
+	struct mod_proxy_priv *priv = smtp_priv_lookup(ctx, &mod_proxy_module);
 
-	smtp_client_command(priv->sock, "RSET", NULL);
-	smtp_client_response(priv->sock, copy_response_callback, ctx);
+	/* never connected, the local response stands */
+	smtp_server_resolve(ctx, stream);
+	if (priv == NULL)
+		return 0;
 
-	return ctx->code >= 200 && ctx->code <= 299 ? 0 : 0;
-}
+	if (smtp_client_command(priv->sock, "RSET", NULL) ||
+			smtp_client_response(priv->sock, copy_response_callback, ctx) < 0)
+		return mod_proxy_unavailable(ctx);
 
-/* void __attribute__((constructor)) my_init() */
+	return 0;
+}
 
 void mod_proxy_init(void)
 {
-	key = smtp_priv_key(module);
 }
 
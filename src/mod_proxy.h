@@ -27,6 +27,20 @@
 
 struct mod_proxy_priv {
 	bfd_t *sock;
+	/* Upstream server advertised PIPELINING (RFC 2920) */
+	int pipelining;
 };
 
+void mod_proxy_init(void);
+int mod_proxy_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+int mod_proxy_hdlr_rcpt(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+int mod_proxy_hdlr_body(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+int mod_proxy_hdlr_rset(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+int mod_proxy_hdlr_term(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+
 #endif
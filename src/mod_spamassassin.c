@@ -38,9 +38,11 @@
 
 #include "smtp_server.h"
 
-static uint64_t key;
 static const char *module = "spamassassin";
 
+void mod_spamassassin_init(void);
+SMTP_MODULE(mod_spamassassin_module, "spamassassin", mod_spamassassin_init);
+
 #include "pexec.h"
 
 int mod_spamassassin_send_headers(struct smtp_server_context *ctx, bfd_t *fw)
@@ -59,8 +59,57 @@ int pexec(char * const *argv, int fd_in, int fd_out)
 	return 127;
 }
 
+static int pexec_copy_range(bfd_t *src, bfd_t *dst, off_t len)
+{
+	char buf[4096];
+	ssize_t sz;
+
+	while (len > 0) {
+		sz = bfd_read(src, buf, len < sizeof(buf) ? len : sizeof(buf));
+		if (sz <= 0)
+			return -1;
+		if (bfd_write_full(dst, buf, sz) < 0)
+			return -1;
+		len -= sz;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the message body to the child process. Leaf parts that are
+ * rejected by the filter are sent with an empty body; this preserves
+ * the MIME structure, but spares the scanner from processing them.
+ */
+static int pexec_copy_body(struct smtp_server_context *ctx, bfd_t *fw, pexec_part_filter_t pexec_part_filter)
+{
+	struct mime_part *part;
+	off_t pos = 0;
+
+	if (bfd_seek(ctx->body.stream, 0, SEEK_SET) == -1)
+		return -1;
+
+	if (pexec_part_filter == NULL)
+		return bfd_copy(ctx->body.stream, fw);
+
+	list_for_each_entry(part, &ctx->body.parts, lh) {
+		if (mime_part_is_multipart(part) || part->body_start < pos)
+			continue;
+		if (pexec_part_filter(ctx, part))
+			continue;
+		if (pexec_copy_range(ctx->body.stream, fw, part->body_start - pos))
+			return -1;
+		pos = part->body_end;
+		if (bfd_seek(ctx->body.stream, pos, SEEK_SET) == -1)
+			return -1;
+	}
+
+	return bfd_copy(ctx->body.stream, fw);
+}
+
 int __pexec_hdlr_body(struct smtp_server_context *ctx, const char *module, char * const *argv,
-		pexec_send_headers_t pexec_send_headers, pexec_result_t pexec_result)
+		pexec_send_headers_t pexec_send_headers, pexec_result_t pexec_result,
+		pexec_part_filter_t pexec_part_filter)
 {
 	int status = 0, pr[2] = {-1, -1}, pw[2] = {-1, -1};
 	pid_t pid;
@@ -106,8 +155,7 @@ int __pexec_hdlr_body(struct smtp_server_context *ctx, const char *module, char
 		goto out_err;
 	}
 
-	bfd_seek(ctx->body.stream, 0, SEEK_SET);
-	if (bfd_copy(ctx->body.stream, fw)) {
+	if (pexec_copy_body(ctx, fw, pexec_part_filter)) {
 		mod_log(LOG_ERR, "could not copy message body\n");
 		goto out_err;
 	}
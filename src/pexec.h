@@ -25,11 +25,17 @@
 
 typedef int (*pexec_send_headers_t)(struct smtp_server_context *ctx, bfd_t *fw);
 typedef int (*pexec_result_t)(struct smtp_server_context *ctx, bfd_t *fr, int status);
+/* Return non-zero if the body of the given (leaf) MIME part must be sent
+ * to the child process */
+typedef int (*pexec_part_filter_t)(struct smtp_server_context *ctx, struct mime_part *part);
 
 int pexec(char * const *argv, int fd_in, int fd_out);
 #define pexec_hdlr_body(_ctx, _argv, _h, _r) \
-	__pexec_hdlr_body(_ctx, module, _argv, _h, _r)
+	__pexec_hdlr_body(_ctx, module, _argv, _h, _r, NULL)
+#define pexec_hdlr_body_filter(_ctx, _argv, _h, _r, _f) \
+	__pexec_hdlr_body(_ctx, module, _argv, _h, _r, _f)
 int __pexec_hdlr_body(struct smtp_server_context *ctx, const char *module, char * const *argv,
-		pexec_send_headers_t pexec_send_headers, pexec_result_t pexec_result);
+		pexec_send_headers_t pexec_send_headers, pexec_result_t pexec_result,
+		pexec_part_filter_t pexec_part_filter);
 
 #endif
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "shm_cache.h"
+
+struct shm_cache_entry {
+	uint32_t hash;
+	/* Expiry time, on the monotonic clock; 0 if the entry is free */
+	uint32_t expires;
+	uint16_t key_len, val_len;
+	uint32_t reserved;
+	/* The key, followed by the value */
+	char data[SHM_CACHE_DATA];
+};
+
+struct shm_cache {
+	/* Number of buckets; a power of 2 */
+	uint32_t buckets;
+	pthread_mutex_t locks[SHM_CACHE_STRIPES];
+	struct shm_cache_entry entries[];
+};
+
+#define SHM_CACHE_NEVER UINT32_MAX
+
+static struct shm_cache *shm_cache;
+
+static uint32_t shm_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	/* never 0, which marks free entries */
+	return (uint32_t)ts.tv_sec + 1;
+}
+
+/* FNV-1a; never 0 */
+static uint32_t shm_cache_hash(const char *key, size_t key_len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < key_len; i++)
+		h = (h ^ (unsigned char)key[i]) * 16777619U;
+
+	return h ? h : 1;
+}
+
+/*
+ * Create the cache, with room for (at least) the given number of entries.
+ * Must be called by the master, before the workers are forked.
+ */
+int shm_cache_init(unsigned long entries)
+{
+	pthread_mutexattr_t attr;
+	uint32_t buckets = SHM_CACHE_STRIPES;
+	size_t size;
+	int i, err;
+
+	if (!entries)
+		return 0;
+
+	while ((unsigned long)buckets * SHM_CACHE_WAYS < entries)
+		buckets <<= 1;
+
+	size = sizeof(struct shm_cache) + (size_t)buckets * SHM_CACHE_WAYS * sizeof(struct shm_cache_entry);
+	shm_cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm_cache == MAP_FAILED) {
+		shm_cache = NULL;
+		return -errno;
+	}
+
+	/* the mapping is zero filled, so all entries are free */
+	shm_cache->buckets = buckets;
+
+	if ((err = pthread_mutexattr_init(&attr)))
+		goto out_err;
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	/* a worker that dies holding a lock must not block the others */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	for (i = 0; i < SHM_CACHE_STRIPES; i++)
+		if ((err = pthread_mutex_init(&shm_cache->locks[i], &attr)))
+			break;
+	pthread_mutexattr_destroy(&attr);
+	if (!err)
+		return 0;
+
+out_err:
+	munmap(shm_cache, size);
+	shm_cache = NULL;
+	return -err;
+}
+
+/*
+ * Lock the bucket of the given hash and return its first entry, or NULL
+ * if there is no cache
+ */
+static struct shm_cache_entry *shm_cache_lock(uint32_t hash, pthread_mutex_t **lock)
+{
+	uint32_t bucket;
+	int i;
+
+	if (shm_cache == NULL)
+		return NULL;
+
+	bucket = hash & (shm_cache->buckets - 1);
+	*lock = &shm_cache->locks[bucket % SHM_CACHE_STRIPES];
+
+	if (pthread_mutex_lock(*lock) == EOWNERDEAD) {
+		/* The owner died in the middle of an update: the entries of
+		 * the stripe cannot be trusted */
+		for (i = bucket % SHM_CACHE_STRIPES; i < (int)shm_cache->buckets; i += SHM_CACHE_STRIPES)
+			memset(&shm_cache->entries[i * SHM_CACHE_WAYS], 0,
+					SHM_CACHE_WAYS * sizeof(struct shm_cache_entry));
+		pthread_mutex_consistent(*lock);
+	}
+
+	return &shm_cache->entries[bucket * SHM_CACHE_WAYS];
+}
+
+/* Find key in the (locked) bucket; expired entries are freed on the way */
+static struct shm_cache_entry *shm_cache_find(struct shm_cache_entry *bucket, uint32_t hash,
+		const char *key, size_t key_len, uint32_t now)
+{
+	struct shm_cache_entry *e;
+
+	for (e = bucket; e < bucket + SHM_CACHE_WAYS; e++) {
+		if (e->expires && e->expires <= now)
+			e->expires = 0;
+		if (e->expires && e->hash == hash && e->key_len == key_len &&
+				!memcmp(e->data, key, key_len))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* The entry of the (locked) bucket to store a new key in */
+static struct shm_cache_entry *shm_cache_victim(struct shm_cache_entry *bucket)
+{
+	struct shm_cache_entry *e, *victim = bucket;
+
+	for (e = bucket; e < bucket + SHM_CACHE_WAYS; e++) {
+		if (!e->expires)
+			return e;
+		if (e->expires < victim->expires)
+			victim = e;
+	}
+
+	return victim;
+}
+
+static void shm_cache_store(struct shm_cache_entry *e, uint32_t hash, const char *key, size_t key_len,
+		const char *val, size_t val_len, uint32_t expires)
+{
+	e->hash = hash;
+	e->expires = expires;
+	e->key_len = key_len;
+	e->val_len = val_len;
+	memcpy(e->data, key, key_len);
+	memcpy(e->data + key_len, val, val_len);
+}
+
+static uint32_t shm_cache_expires(uint32_t now, unsigned int ttl)
+{
+	return ttl && ttl < SHM_CACHE_NEVER - now ? now + ttl : SHM_CACHE_NEVER;
+}
+
+ssize_t shm_cache_get(const char *key, size_t key_len, char *val, size_t size)
+{
+	uint32_t hash = shm_cache_hash(key, key_len);
+	struct shm_cache_entry *bucket, *e;
+	pthread_mutex_t *lock;
+	ssize_t ret = -ENOENT;
+
+	if ((bucket = shm_cache_lock(hash, &lock)) == NULL)
+		return -ENOENT;
+
+	if ((e = shm_cache_find(bucket, hash, key, key_len, shm_cache_now())) != NULL) {
+		ret = e->val_len <= size ? e->val_len : -ENOBUFS;
+		if (ret >= 0)
+			memcpy(val, e->data + e->key_len, e->val_len);
+	}
+
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+int shm_cache_set(const char *key, size_t key_len, const char *val, size_t val_len, unsigned int ttl)
+{
+	uint32_t hash = shm_cache_hash(key, key_len), now;
+	struct shm_cache_entry *bucket, *e;
+	pthread_mutex_t *lock;
+
+	if (key_len + val_len > SHM_CACHE_DATA)
+		return -E2BIG;
+
+	if ((bucket = shm_cache_lock(hash, &lock)) == NULL)
+		return -ENOMEM;
+
+	now = shm_cache_now();
+	if ((e = shm_cache_find(bucket, hash, key, key_len, now)) == NULL)
+		e = shm_cache_victim(bucket);
+	shm_cache_store(e, hash, key, key_len, val, val_len, shm_cache_expires(now, ttl));
+
+	pthread_mutex_unlock(lock);
+	return 0;
+}
+
+int shm_cache_del(const char *key, size_t key_len)
+{
+	uint32_t hash = shm_cache_hash(key, key_len);
+	struct shm_cache_entry *bucket, *e;
+	pthread_mutex_t *lock;
+
+	if ((bucket = shm_cache_lock(hash, &lock)) == NULL)
+		return -ENOENT;
+
+	if ((e = shm_cache_find(bucket, hash, key, key_len, shm_cache_now())) != NULL)
+		e->expires = 0;
+
+	pthread_mutex_unlock(lock);
+	return e != NULL ? 0 : -ENOENT;
+}
+
+int shm_cache_incr(const char *key, size_t key_len, long delta, unsigned int ttl, long *value)
+{
+	uint32_t hash = shm_cache_hash(key, key_len), now, expires;
+	struct shm_cache_entry *bucket, *e;
+	pthread_mutex_t *lock;
+	char buf[24];
+	int len;
+
+	if (key_len + sizeof(buf) > SHM_CACHE_DATA)
+		return -E2BIG;
+
+	if ((bucket = shm_cache_lock(hash, &lock)) == NULL)
+		return -ENOMEM;
+
+	now = shm_cache_now();
+	*value = delta;
+	expires = shm_cache_expires(now, ttl);
+	if ((e = shm_cache_find(bucket, hash, key, key_len, now)) != NULL) {
+		len = e->val_len < sizeof(buf) ? e->val_len : sizeof(buf) - 1;
+		memcpy(buf, e->data + e->key_len, len);
+		buf[len] = '\0';
+		*value += strtol(buf, NULL, 10);
+		expires = e->expires;
+	} else
+		e = shm_cache_victim(bucket);
+
+	len = snprintf(buf, sizeof(buf), "%ld", *value);
+	shm_cache_store(e, hash, key, key_len, buf, len, expires);
+
+	pthread_mutex_unlock(lock);
+	return 0;
+}
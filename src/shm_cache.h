@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SHM_CACHE_H
+#define _SHM_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Key/value cache shared by all the workers. It lives in an anonymous
+ * shared mapping created by the master before it forks, so it survives
+ * the sessions and the data stored by one worker is seen by the others.
+ *
+ * The table has a fixed size. It is set associative: a key can only be
+ * in one of the SHM_CACHE_WAYS entries of its bucket, and when they are
+ * all taken the entry that expires first is replaced. Buckets are guarded
+ * by a fixed number of (robust, process shared) locks.
+ */
+#define SHM_CACHE_WAYS 8
+#define SHM_CACHE_STRIPES 64
+
+/* Room for the key and the value of an entry */
+#define SHM_CACHE_DATA 232
+
+int shm_cache_init(unsigned long entries);
+
+/*
+ * Copy the value of key to val. Returns the length of the value, -ENOENT
+ * if the key is not in the cache (or expired) or -ENOBUFS if the value
+ * does not fit in size bytes.
+ */
+ssize_t shm_cache_get(const char *key, size_t key_len, char *val, size_t size);
+
+/*
+ * Store a value that expires after ttl seconds; 0 means that it does not
+ * expire (but may still be evicted). Returns -E2BIG if the key and the
+ * value do not fit in an entry.
+ */
+int shm_cache_set(const char *key, size_t key_len, const char *val, size_t val_len, unsigned int ttl);
+
+int shm_cache_del(const char *key, size_t key_len);
+
+/*
+ * Add delta to the (decimal) number stored at key and return the result
+ * in *value. A missing key counts as 0 and is created with the given
+ * ttl; an existing one keeps its expiry time, so that counters measure
+ * fixed time windows.
+ */
+int shm_cache_incr(const char *key, size_t key_len, long delta, unsigned int ttl, long *value);
+
+#endif
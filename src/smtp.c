@@ -26,6 +26,26 @@
 
 const char *white = "\r\n\t ";
 
+void smtp_path_init(struct smtp_path *path)
+{
+	memset(path, 0, sizeof(struct smtp_path));
+	INIT_LIST_HEAD(&path->domains);
+	INIT_LIST_HEAD(&path->mailbox.domain.lh);
+}
+
+/*
+ * Move the parsed path in src to dst. A plain structure copy would leave
+ * the source route list pointing back to src.
+ */
+void smtp_path_move(struct smtp_path *dst, struct smtp_path *src)
+{
+	smtp_path_init(dst);
+	dst->mailbox.local = src->mailbox.local;
+	dst->mailbox.domain.domain = src->mailbox.domain.domain;
+	list_splice(&src->domains, &dst->domains);
+	smtp_path_init(src);
+}
+
 char *smtp_path_to_string(struct smtp_path *path)
 {
 	struct string_buffer sb = STRING_BUFFER_INITIALIZER;
@@ -34,12 +54,13 @@ char *smtp_path_to_string(struct smtp_path *path)
 	if (string_buffer_append_char(&sb, '<'))
 		goto out_err;
 
+	/* source route: "@one,@two:" */
 	list_for_each_entry(domain, &path->domains, lh) {
 		if (string_buffer_append_char(&sb, '@'))
 			goto out_err;
 		if (string_buffer_append_string(&sb, domain->domain))
 			goto out_err;
-		if (string_buffer_append_char(&sb, ':'))
+		if (string_buffer_append_char(&sb, domain->lh.next == &path->domains ? ':' : ','))
 			goto out_err;
 	}
 
@@ -54,14 +75,14 @@ char *smtp_path_to_string(struct smtp_path *path)
 
 	if (string_buffer_append_char(&sb, '>'))
 		goto out_err;
-	return sb.s;
+	return string_buffer_detach(&sb);
 
 out_err:
 	string_buffer_cleanup(&sb);
 	return NULL;
 }
 
-int smtp_path_parse(jsval *path, const char *arg, char **trailing)
+int smtp_path_parse(struct smtp_path *path, char *arg, struct arena *arena, char **trailing)
 {
 	enum {
 		S_INIT,
@@ -71,8 +92,7 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 		S_MBOX_DOMAIN,
 		S_FINAL
 	} state = S_INIT;
-	const char *token = NULL;
-	char *aux = NULL;
+	char *token = NULL;
 	struct smtp_domain *domain;
 
 	while (*arg != '\0') {
@@ -94,6 +114,7 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 				continue;
 			}
 			if (*arg == '>') {
+				path->mailbox.local = EMPTY_STRING;
 				arg++;
 				state = S_FINAL;
 				continue;
@@ -105,17 +126,20 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 			if (*arg == ',' || *arg == ':') {
 				if (token == arg)
 					return 1;
-				aux = strndup(token, arg - token);
-				add_domain(path, aux);
-				free(aux);
+				domain = arena_alloc(arena, sizeof(struct smtp_domain));
+				if (domain == NULL)
+					return 1;
+				domain->domain = token;
+				list_add_tail(&domain->lh, &path->domains);
 			}
 			if (*arg == ',') {
-				++arg;
+				*(arg++) = '\0';
 				state = S_SEPARATOR;
 				continue;
 			}
 			if (*arg == ':') {
-				token = ++arg;
+				*(arg++) = '\0';
+				token = arg;
 				state = S_MBOX_LOCAL;
 				continue;
 			}
@@ -125,13 +149,10 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 			if (*arg == '@') {
 				if (token == arg)
 					return 1;
-
-				aux = strndup(token, arg - token);
-				add_path_local(path, aux);
-				free(aux);
-
+				path->mailbox.local = token;
+				*(arg++) = '\0';
 				state = S_MBOX_DOMAIN;
-				token = ++arg;
+				token = arg;
 				continue;
 			}
 			arg++;
@@ -140,11 +161,8 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 			if (*arg == '>') {
 				if (token == arg)
 					return 1;
-
-				aux = strndup(token, arg - token);
-				add_path_domain(path, aux);
-				free(aux);
-
+				path->mailbox.domain.domain = token;
+				*arg = '\0';
 				state = S_FINAL;
 			}
 			arg++;
@@ -160,5 +178,39 @@ int smtp_path_parse(jsval *path, const char *arg, char **trailing)
 		}
 	}
 
+	if (state == S_FINAL && trailing)
+		*trailing = arg;
+
 	return state == S_FINAL ? 0 : 1;
 }
+
+/*
+ * Find a multiplier that maps the n commands to distinct slots. Returns
+ * -1 if a command name is invalid or no multiplier was found.
+ */
+int smtp_cmd_hash_init(struct smtp_cmd_hash *hash, const char * const *cmds, int n)
+{
+	uint32_t key, mult = 0x9e3779b1;
+	unsigned int slot;
+	int i, tries;
+
+	if (n > SMTP_CMD_HASH_SIZE)
+		return -1;
+
+	for (tries = 0; tries < 65536; tries++, mult += 2) {
+		hash->mult = mult;
+		memset(hash->keys, 0, sizeof(hash->keys));
+		for (i = 0; i < n; i++) {
+			if (!(key = smtp_cmd_key(cmds[i])))
+				return -1;
+			slot = smtp_cmd_hash_slot(hash, key);
+			if (hash->keys[slot])
+				break;
+			hash->keys[slot] = key;
+		}
+		if (i == n)
+			return 0;
+	}
+
+	return -1;
+}
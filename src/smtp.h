@@ -21,11 +21,28 @@
 #ifndef _SMTP_H
 #define _SMTP_H
 
+#include <stdint.h>
+#include <ctype.h>
+
 #include "list.h"
-#include "js/js.h"
+#include "arena.h"
 
 #define SMTP_COMMAND_MAX 512
 
+/*
+ * Perfect hash over a fixed set of (4-letter) SMTP command names, built
+ * once by smtp_cmd_hash_init(). A lookup costs a multiplication and a
+ * comparison; users keep their data in an array indexed by the slot.
+ */
+#define SMTP_CMD_HASH_BITS 5
+#define SMTP_CMD_HASH_SIZE (1 << SMTP_CMD_HASH_BITS)
+
+struct smtp_cmd_hash {
+	uint32_t mult;
+	/* Key of the command in each slot, 0 if the slot is empty */
+	uint32_t keys[SMTP_CMD_HASH_SIZE];
+};
+
 #define EMPTY_STRING ((void *)1)
 
 struct smtp_domain {
@@ -38,13 +55,66 @@ struct smtp_mailbox {
 	struct smtp_domain domain;
 };
 
+/*
+ * Parsed SMTP path (RFC 5321 section 4.1.2). The strings point into the
+ * buffer that was passed to smtp_path_parse(). The null path ("<>") has
+ * .mailbox.local set to EMPTY_STRING.
+ */
 struct smtp_path {
 	struct smtp_mailbox mailbox;
 	struct list_head domains;
 };
 
 extern const char *white;
+void smtp_path_init(struct smtp_path *path);
+void smtp_path_move(struct smtp_path *dst, struct smtp_path *src);
 char *smtp_path_to_string(struct smtp_path *path);
-int smtp_path_parse(jsval *path, const char *arg, char **trailing);
+
+/*
+ * Parses the path in arg and fills in the (already initialized) path.
+ * The parsing is done in place: the separators in arg are replaced with
+ * the null character and the path components point into arg. Source
+ * route domains are allocated from arena.
+ *
+ * If trailing is not NULL, parsing stops after the closing '>' and
+ * *trailing is set to the rest of the string. Returns 0 on success.
+ */
+int smtp_path_parse(struct smtp_path *path, char *arg, struct arena *arena, char **trailing);
+
+/*
+ * Command names are case insensitive: the key is the upper case name
+ * packed in 32 bits, or 0 if cmd is not a 4-letter name.
+ */
+static inline uint32_t smtp_cmd_key(const char *cmd)
+{
+	uint32_t key = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!isalpha((unsigned char)cmd[i]))
+			return 0;
+		key = (key << 8) | toupper((unsigned char)cmd[i]);
+	}
+
+	return cmd[4] == '\0' ? key : 0;
+}
+
+static inline unsigned int smtp_cmd_hash_slot(const struct smtp_cmd_hash *hash, uint32_t key)
+{
+	return (key * hash->mult) >> (32 - SMTP_CMD_HASH_BITS);
+}
+
+/*
+ * Return the slot of cmd, or -1 if cmd is not in the set
+ */
+static inline int smtp_cmd_hash_lookup(const struct smtp_cmd_hash *hash, const char *cmd)
+{
+	uint32_t key = smtp_cmd_key(cmd);
+	unsigned int slot = smtp_cmd_hash_slot(hash, key);
+
+	return key && hash->keys[slot] == key ? (int)slot : -1;
+}
+
+int smtp_cmd_hash_init(struct smtp_cmd_hash *hash, const char * const *cmds, int n);
 
 #endif
@@ -19,11 +19,17 @@
  */
 
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #include "smtp_client.h"
 
@@ -79,7 +85,7 @@ int smtp_put_path(bfd_t *stream, struct smtp_path *path)
 			return 1;
 		if (bfd_puts(stream, domain->domain) < 0)
 			return 1;
-		if (bfd_putc(stream, ':') < 0)
+		if (bfd_putc(stream, domain->lh.next == &path->domains ? ':' : ',') < 0)
 			return 1;
 	}
 
@@ -98,7 +104,11 @@ int smtp_put_path(bfd_t *stream, struct smtp_path *path)
 	return 0;
 }
 
-int smtp_put_path_cmd(bfd_t *stream, const char *cmd, struct smtp_path *path)
+/*
+ * Send a MAIL or RCPT command. params are the ESMTP parameters that go
+ * after the path (e.g. "SIZE=1024 BODY=8BITMIME"), or NULL.
+ */
+int smtp_put_path_cmd(bfd_t *stream, const char *cmd, struct smtp_path *path, const char *params)
 {
 	if (bfd_puts(stream, cmd) < 0)
 		return 1;
@@ -106,21 +116,25 @@ int smtp_put_path_cmd(bfd_t *stream, const char *cmd, struct smtp_path *path)
 		return 1;
 	if (smtp_put_path(stream, path))
 		return 1;
-	if (bfd_puts(stream, "\r\n") < 0)
+	if (params != NULL && (bfd_putc(stream, ' ') < 0 || bfd_puts(stream, params) < 0))
 		return 1;
-	if (bfd_flush(stream) < 0)
+	if (bfd_puts(stream, "\r\n") < 0)
 		return 1;
 	return 0;
 }
 
-int smtp_c_mail(bfd_t *stream, struct smtp_path *path)
+int smtp_c_mail(bfd_t *stream, struct smtp_path *path, const char *params)
 {
-	return smtp_put_path_cmd(stream, "MAIL FROM", path);
+	if (smtp_put_path_cmd(stream, "MAIL FROM", path, params))
+		return 1;
+	return bfd_flush(stream) < 0 ? 1 : 0;
 }
 
-int smtp_c_rcpt(bfd_t *stream, struct smtp_path *path)
+int smtp_c_rcpt(bfd_t *stream, struct smtp_path *path, const char *params)
 {
-	return smtp_put_path_cmd(stream, "RCPT TO", path);
+	if (smtp_put_path_cmd(stream, "RCPT TO", path, params))
+		return 1;
+	return bfd_flush(stream) < 0 ? 1 : 0;
 }
 
 int smtp_client_command(bfd_t *stream, const char *cmd, const char *arg)
@@ -180,3 +194,81 @@ int smtp_copy_from_file(bfd_t *out, bfd_t *in)
 
 	return 0;
 }
+
+/*
+ * Send len bytes of the mapped file fd, starting at *off, straight to the
+ * out stream. Falls back to copying from the mapping if the kernel cannot
+ * sendfile() to that kind of file.
+ */
+static int smtp_sendfile(bfd_t *out, int fd, const char *map, off_t *off, size_t len)
+{
+	ssize_t sz;
+
+	if (bfd_flush(out) < 0)
+		return 1;
+
+	while (len) {
+		sz = sendfile(out->fd, fd, off, len);
+		if (sz < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			if (bfd_write_full(out, map + *off, len) < 0)
+				return 1;
+			*off += len;
+			return 0;
+		}
+		if (sz <= 0)
+			return 1;
+		len -= sz;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the spooled message body (the whole file behind the in stream) as
+ * DATA content: lines that start with a dot are stuffed and the
+ * termination marker is appended. The file is mapped only to find the dot
+ * lines; the data between them goes to out with sendfile(), without being
+ * copied through user space. smtp_copy_from_file() is the fallback.
+ */
+int smtp_send_file(bfd_t *out, bfd_t *in)
+{
+	const char *map, *p, *q, *end;
+	struct stat st;
+	off_t off = 0;
+	int ret = 1;
+
+	if (bfd_flush(in) < 0 || fstat(in->fd, &st) == -1)
+		return 1;
+
+	map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in->fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED) {
+		if (bfd_seek(in, 0, SEEK_SET) == -1)
+			return 1;
+		return smtp_copy_from_file(out, in);
+	}
+	end = map + st.st_size;
+
+	if (*map == '.' && bfd_putc(out, '.') < 0)
+		goto out;
+
+	for (p = map; (q = memmem(p, end - p, "\n.", 2)) != NULL; p = q + 1) {
+		if (smtp_sendfile(out, in->fd, map, &off, q + 1 - map - off))
+			goto out;
+		if (bfd_putc(out, '.') < 0)
+			goto out;
+	}
+
+	if (smtp_sendfile(out, in->fd, map, &off, st.st_size - off))
+		goto out;
+
+	/* send termination marker */
+	if ((st.st_size < 2 || end[-2] != '\r' || end[-1] != '\n') && bfd_puts(out, "\r\n") < 0)
+		goto out;
+	if (bfd_puts(out, ".\r\n") < 0)
+		goto out;
+
+	ret = 0;
+out:
+	munmap((void *)map, st.st_size);
+	return ret;
+}
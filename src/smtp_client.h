@@ -33,8 +33,9 @@ enum {
 int smtp_client_response(bfd_t *stream, smtp_client_callback_t callback, void *priv);
 int smtp_client_command(bfd_t *stream, const char *cmd, const char *arg);
 int smtp_copy_from_file(bfd_t *out, bfd_t *in);
+int smtp_send_file(bfd_t *out, bfd_t *in);
 int smtp_put_path(bfd_t *stream, struct smtp_path *path);
-int smtp_put_path_cmd(bfd_t *stream, const char *cmd, struct smtp_path *path);
-int smtp_c_mail(bfd_t *stream, struct smtp_path *path);
-int smtp_c_rcpt(bfd_t *stream, struct smtp_path *path);
+int smtp_put_path_cmd(bfd_t *stream, const char *cmd, struct smtp_path *path, const char *params);
+int smtp_c_mail(bfd_t *stream, struct smtp_path *path, const char *params);
+int smtp_c_rcpt(bfd_t *stream, struct smtp_path *path, const char *params);
 #endif
@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "js/js.h"
+
+#include "smtp_rules.h"
+#include "smtp_client.h"
+#include "string_tools.h"
+
+static const char *module = "rules";
+
+/* What the rules of a command can look at and do */
+#define SMTP_RULE_DOMAIN	0x01
+#define SMTP_RULE_RELAY_OK	0x02
+
+static const char *smtp_rule_cmds[] = {
+	"INIT", "EHLO", "HELO", "MAIL", "RCPT", "DATA", "RSET"
+};
+static const int smtp_rule_flags[] = {
+	0,
+	SMTP_RULE_DOMAIN | SMTP_RULE_RELAY_OK,
+	SMTP_RULE_DOMAIN | SMTP_RULE_RELAY_OK,
+	SMTP_RULE_DOMAIN | SMTP_RULE_RELAY_OK,
+	SMTP_RULE_DOMAIN | SMTP_RULE_RELAY_OK,
+	0,
+	SMTP_RULE_RELAY_OK
+};
+#define SMTP_RULE_CMDS (sizeof(smtp_rule_cmds) / sizeof(smtp_rule_cmds[0]))
+
+/* Rule lists and flags, indexed by the smtp_rules_hash slot of the command */
+static struct smtp_cmd_hash smtp_rules_hash;
+static struct {
+	struct list_head rules;
+	int flags;
+} smtp_rules[SMTP_CMD_HASH_SIZE];
+static int smtp_rule_count;
+
+static int smtp_rules_init(void)
+{
+	unsigned int i;
+	int slot;
+
+	if (smtp_cmd_hash_init(&smtp_rules_hash, smtp_rule_cmds, SMTP_RULE_CMDS))
+		return -1;
+
+	for (i = 0; i < SMTP_RULE_CMDS; i++) {
+		slot = smtp_cmd_hash_lookup(&smtp_rules_hash, smtp_rule_cmds[i]);
+		INIT_LIST_HEAD(&smtp_rules[slot].rules);
+		smtp_rules[slot].flags = smtp_rule_flags[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Append a new (empty) rule to the table of the given command. Returns
+ * NULL if rules are not supported for the command.
+ */
+struct smtp_rule *smtp_rule_add(const char *cmd)
+{
+	struct smtp_rule *rule;
+	int slot;
+
+	if (!smtp_rule_count && smtp_rules_init())
+		return NULL;
+
+	if ((slot = smtp_cmd_hash_lookup(&smtp_rules_hash, cmd)) < 0)
+		return NULL;
+
+	if ((rule = calloc(1, sizeof(struct smtp_rule))) == NULL)
+		return NULL;
+
+	rule->action = SMTP_RULE_REPLY;
+	rule->flags = smtp_rules[slot].flags;
+	list_add_tail(&rule->lh, &smtp_rules[slot].rules);
+	smtp_rule_count++;
+
+	return rule;
+}
+
+int smtp_rule_add_domain(struct smtp_rule *rule, const char *domain)
+{
+	char **domains, *p;
+
+	domains = realloc(rule->domains, (rule->domain_count + 1) * sizeof(char *));
+	if (domains == NULL)
+		return -ENOMEM;
+	rule->domains = domains;
+
+	if ((p = strdup(domain)) == NULL)
+		return -ENOMEM;
+	rule->domains[rule->domain_count++] = p;
+
+	for (; *p != '\0'; p++)
+		*p = tolower((unsigned char)*p);
+
+	return 0;
+}
+
+/* Parse an "a.b.c.d[/len]" network specification */
+int smtp_rule_add_client(struct smtp_rule *rule, const char *cidr)
+{
+	struct smtp_rule_net *clients;
+	char buf[INET_ADDRSTRLEN], *p;
+	struct in_addr addr;
+	unsigned long len = 32;
+	size_t n = strcspn(cidr, "/");
+
+	if (n >= sizeof(buf))
+		return -EINVAL;
+	memcpy(buf, cidr, n);
+	buf[n] = '\0';
+
+	if (!inet_aton(buf, &addr))
+		return -EINVAL;
+
+	if (cidr[n] == '/') {
+		len = strtoul(&cidr[n + 1], &p, 10);
+		if (p == &cidr[n + 1] || *p != '\0' || len > 32)
+			return -EINVAL;
+	}
+
+	clients = realloc(rule->clients, (rule->client_count + 1) * sizeof(struct smtp_rule_net));
+	if (clients == NULL)
+		return -ENOMEM;
+	rule->clients = clients;
+
+	clients[rule->client_count].mask = len ? htonl(0xffffffffUL << (32 - len)) : 0;
+	clients[rule->client_count].addr = addr.s_addr & clients[rule->client_count].mask;
+	rule->client_count++;
+
+	return 0;
+}
+
+static int smtp_rule_domain_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Check a rule once it is complete and prepare it for lookups. Returns
+ * NULL or the reason why the rule cannot be used.
+ */
+const char *smtp_rule_commit(struct smtp_rule *rule)
+{
+	if (rule->domain_count && !(rule->flags & SMTP_RULE_DOMAIN))
+		return "domain conditions are not supported for this command";
+
+	switch (rule->action) {
+	case SMTP_RULE_REPLY:
+		if (rule->code < 200 || rule->code > 599)
+			return "reply code must be between 200 and 599";
+		if (rule->message == NULL)
+			return "reply rules need a message";
+		break;
+	case SMTP_RULE_RELAY:
+		if (!(rule->flags & SMTP_RULE_RELAY_OK))
+			return "this command cannot be relayed";
+		break;
+	}
+
+	qsort(rule->domains, rule->domain_count, sizeof(char *), smtp_rule_domain_cmp);
+
+	return NULL;
+}
+
+static int smtp_rule_has_domain(struct smtp_rule *rule, const char *domain)
+{
+	return bsearch(&domain, rule->domains, rule->domain_count, sizeof(char *),
+			smtp_rule_domain_cmp) != NULL;
+}
+
+/* domain is lowercase */
+static int smtp_rule_match_domain(struct smtp_rule *rule, const char *domain)
+{
+	const char *p;
+
+	if (smtp_rule_has_domain(rule, domain))
+		return 1;
+
+	for (p = strchr(domain, '.'); p != NULL; p = strchr(p + 1, '.'))
+		if (smtp_rule_has_domain(rule, p))
+			return 1;
+
+	return 0;
+}
+
+static int smtp_rule_match_client(struct smtp_rule *rule, struct in_addr addr)
+{
+	int i;
+
+	for (i = 0; i < rule->client_count; i++)
+		if ((addr.s_addr & rule->clients[i].mask) == rule->clients[i].addr)
+			return 1;
+
+	return 0;
+}
+
+static int smtp_rule_relay_callback(int code, const char *message, int last, void *priv)
+{
+	struct string_buffer *sb = priv;
+
+	if (sb->cur && string_buffer_append_char(sb, '\n'))
+		return 1;
+	return string_buffer_append_string(sb, message) ? 1 : 0;
+}
+
+/*
+ * Forward the command to the upstream server that the script connected
+ * smtpClient to and pass its response back to the client
+ */
+static void smtp_rule_relay(struct smtp_server_context *ctx, const char *cmd,
+		const char *arg, struct smtp_path *path)
+{
+	struct string_buffer sb = STRING_BUFFER_INITIALIZER;
+	bfd_t *upstream = js_smtp_client_stream();
+	int err, code;
+
+	if (upstream == NULL) {
+		mod_log(LOG_ERR, "cannot relay %s: smtpClient is not connected\n", cmd);
+		goto out_err;
+	}
+
+	if (!strcmp(cmd, "MAIL"))
+		err = smtp_c_mail(upstream, path, arg);
+	else if (!strcmp(cmd, "RCPT"))
+		err = smtp_c_rcpt(upstream, path, arg);
+	else
+		err = smtp_client_command(upstream, cmd, arg);
+	if (err)
+		goto out_err;
+
+	code = smtp_client_response(upstream, smtp_rule_relay_callback, &sb);
+	if (code < 0)
+		goto out_err;
+
+	ctx->code = code;
+	ctx->message = string_buffer_detach(&sb);
+	return;
+
+out_err:
+	string_buffer_cleanup(&sb);
+	ctx->code = 451;
+	ctx->message = strdup("Upstream server not available");
+}
+
+int smtp_rules_eval(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, int *disconnect)
+{
+	char domain[SMTP_COMMAND_MAX + 1];
+	struct smtp_rule *rule;
+	const char *p = NULL;
+	size_t i;
+	int slot;
+
+	if (!smtp_rule_count)
+		return 0;
+
+	if ((slot = smtp_cmd_hash_lookup(&smtp_rules_hash, cmd)) < 0)
+		return 0;
+
+	/* The domain that the domain conditions look at: the one of the
+	 * path, or the argument of HELO and EHLO */
+	if (path != NULL)
+		p = path->mailbox.domain.domain;
+	else if (smtp_rules[slot].flags & SMTP_RULE_DOMAIN)
+		p = arg;
+	for (i = 0; p != NULL && p[i] != '\0' && i < SMTP_COMMAND_MAX; i++)
+		domain[i] = tolower((unsigned char)p[i]);
+	domain[i] = '\0';
+
+	list_for_each_entry(rule, &smtp_rules[slot].rules, lh) {
+		if (rule->domain_count && !smtp_rule_match_domain(rule, domain))
+			continue;
+		if (rule->client_count && !smtp_rule_match_client(rule, ctx->addr.sin_addr))
+			continue;
+
+		if (rule->action == SMTP_RULE_RELAY) {
+			smtp_rule_relay(ctx, cmd, arg, path);
+		} else {
+			ctx->code = rule->code;
+			ctx->message = strdup(rule->message);
+		}
+		*disconnect = rule->disconnect;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2010 Mindbit SRL
+ *
+ * This file is part of mailfilter.
+ *
+ * mailfilter is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * mailfilter is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program; if not, write to the Free Software 
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SMTP_RULES_H
+#define _SMTP_RULES_H
+
+#include <netinet/in.h>
+
+#include "smtp_server.h"
+
+/*
+ * Native decision table, compiled from the smtpServer.rules array of the
+ * configuration script. The rules of a command are tried in order before
+ * its JS handler; the first one whose conditions all hold decides the
+ * response and the handler is not called at all.
+ */
+enum smtp_rule_action {
+	/* Reply with the rule's code and message */
+	SMTP_RULE_REPLY,
+	/* Forward the command to the upstream server of smtpClient and
+	 * reply with its response */
+	SMTP_RULE_RELAY
+};
+
+struct smtp_rule_net {
+	in_addr_t addr, mask;
+};
+
+struct smtp_rule {
+	struct list_head lh;
+
+	/* Conditions; a rule without conditions always matches. Domains are
+	 * lowercase and sorted; an entry that starts with a dot matches the
+	 * subdomains of the domain that follows. */
+	char **domains;
+	int domain_count;
+	struct smtp_rule_net *clients;
+	int client_count;
+
+	/* Decision */
+	enum smtp_rule_action action;
+	int code;
+	char *message;
+	int disconnect;
+
+	/* What the rules of the command can look at and do */
+	int flags;
+};
+
+struct smtp_rule *smtp_rule_add(const char *cmd);
+int smtp_rule_add_domain(struct smtp_rule *rule, const char *domain);
+int smtp_rule_add_client(struct smtp_rule *rule, const char *cidr);
+const char *smtp_rule_commit(struct smtp_rule *rule);
+
+/*
+ * Try the rules of the given command. Returns 1 and sets the code,
+ * message and *disconnect if a rule decided, or 0 if the command must go
+ * to the JS handler. path is the path of a MAIL or RCPT command and arg
+ * its ESMTP parameters (or NULL), which are relayed along with it; for
+ * HELO and EHLO, arg is the domain. arg must not contain the line ending.
+ */
+int smtp_rules_eval(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, int *disconnect);
+
+#endif
@@ -35,10 +35,16 @@
 #include <time.h>
 #include <netdb.h>
 #include <limits.h>
+#include <poll.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <dlfcn.h>
 
 #include "js/js.h"
 
 #include "smtp_server.h"
+#include "smtp_rules.h"
+#include "shm_cache.h"
 #include "smtp.h"
 #include "base64.h"
 
@@ -61,6 +67,16 @@ static struct smtp_cmd_hdlr smtp_cmd_hdlrs[PREPROCESS_HDLRS_LEN] = {
 	DEFINE_SMTP_CMD_HDLR(quit)
 };
 
+/* Index of smtp_cmd_hdlrs, built by smtp_server_init() */
+static struct smtp_cmd_hash smtp_cmd_hash;
+static struct smtp_cmd_hdlr *smtp_cmd_slots[SMTP_CMD_HASH_SIZE];
+
+/* Module hooks of each command, indexed like smtp_cmd_slots */
+static struct smtp_module_hook smtp_cmd_hooks[SMTP_CMD_HASH_SIZE][SMTP_MODULE_MAX + 1];
+static struct smtp_module_hook smtp_cmd_accept_hooks[SMTP_CMD_HASH_SIZE][SMTP_MODULE_MAX + 1];
+/* Module hooks of the end of the session */
+static struct smtp_module_hook smtp_clnp_hooks[SMTP_MODULE_MAX + 1];
+
 int smtp_server_response(bfd_t *f, int code, const char *message)
 {
 	char *buf = (char *)message, *c;
@@ -74,35 +90,156 @@ int smtp_server_response(bfd_t *f, int code, const char *message)
 	}
 
 	log(&config, LOG_DEBUG, "[%s] <<< %d %s", module, code, buf);
-	if (bfd_printf(f, "%d %s\r\n", code, buf) >= 0) {
-		bfd_flush(f);
-		return 0;
+	/* Responses are not flushed here. With pipelining (RFC 2920) they
+	 * are queued and sent in a single write by smtp_server_read_line()
+	 * once the client has no more commands in flight. */
+	return bfd_printf(f, "%d %s\r\n", code, buf) >= 0 ? 0 : -1;
+}
+
+/*
+ * Queue a response that will be sent later, after the module that called
+ * this resolves it. Until then, responses to subsequent commands are also
+ * queued, so that the client gets them in the right order.
+ */
+struct smtp_deferred *smtp_server_defer(struct smtp_server_context *ctx, smtp_resolve_t resolve, void *priv)
+{
+	struct smtp_deferred *d = malloc(sizeof(struct smtp_deferred));
+
+	if (d == NULL)
+		return NULL;
+
+	d->code = 0;
+	d->message = NULL;
+	d->resolve = resolve;
+	d->priv = priv;
+	d->path = NULL;
+	list_add_tail(&d->lh, &ctx->deferred);
+	ctx->code = SMTP_DEFERRED;
+
+	return d;
+}
+
+/*
+ * Undo the envelope change of a rejected MAIL or RCPT command, so that
+ * neither the following commands nor the scripts see the path.
+ */
+static void smtp_server_drop_path(struct smtp_server_context *ctx, struct smtp_path *path)
+{
+	if (path == &ctx->rpath) {
+		smtp_path_init(&ctx->rpath);
+		set_envelope_sender(&ctx->rpath);
+		return;
 	}
 
-	return -1;
+	list_del(&path->mailbox.domain.lh);
+	drop_recipient(path);
+}
+
+/*
+ * Keep the envelope path of a MAIL or RCPT command whose response was
+ * deferred, until we know whether the command is accepted.
+ */
+static void smtp_server_defer_path(struct smtp_server_context *ctx, struct smtp_path *path)
+{
+	list_entry(ctx->deferred.prev, struct smtp_deferred, lh)->path = path;
+}
+
+/*
+ * Resolve and send all deferred responses. This must be called before
+ * blocking on the client and by modules before they need a synchronous
+ * reply from a server they pipelined commands to.
+ */
+int smtp_server_resolve(struct smtp_server_context *ctx, bfd_t *stream)
+{
+	struct smtp_deferred *d, *d_aux;
+	int ret = 0;
+
+	list_for_each_entry_safe(d, d_aux, &ctx->deferred, lh) {
+		if (!d->code && (d->resolve == NULL || d->resolve(ctx, d) || !d->code)) {
+			free(d->message);
+			d->code = 451;
+			d->message = strdup("Internal server error");
+		}
+		if (d->path != NULL && (d->code < 200 || d->code > 299))
+			smtp_server_drop_path(ctx, d->path);
+		if (smtp_server_response(stream, d->code, d->message ? d->message : ""))
+			ret = -1;
+		list_del(&d->lh);
+		free(d->message);
+		free(d);
+	}
+
+	return ret;
+}
+
+/*
+ * Release the memory that an idle session does not need: the empty
+ * stream buffers and the arena chunks kept for reuse.
+ */
+static void smtp_server_shrink(struct smtp_server_context *ctx, bfd_t *stream)
+{
+	bfd_shrink(stream);
+	arena_trim();
+
+	mod_log(LOG_DEBUG, "idle session uses %zu bytes\n", smtp_server_footprint(ctx));
+}
+
+/*
+ * Memory used by the session, apart from the JavaScript engine: the
+ * context, the streams and the transaction arena.
+ */
+size_t smtp_server_footprint(struct smtp_server_context *ctx)
+{
+	return sizeof(struct smtp_server_context) + bfd_footprint() + arena_footprint();
+}
+
+/*
+ * Read a line from the client. Pending responses are flushed only if the
+ * line is not already buffered, i.e. we would otherwise block waiting
+ * for a client that waits for our responses.
+ */
+static ssize_t smtp_server_read_line(struct smtp_server_context *ctx, bfd_t *stream, char *buf, size_t len)
+{
+	struct pollfd pfd = {.fd = stream->fd, .events = POLLIN};
+
+	if (!bfd_line_buffered(stream)) {
+		smtp_server_resolve(ctx, stream);
+		if (bfd_flush(stream) < 0)
+			return -1;
+		/* if the client keeps quiet, give back the memory that we
+		 * don't need while waiting */
+		if (!poll(&pfd, 1, SMTP_IDLE_TIMEOUT))
+			smtp_server_shrink(ctx, stream);
+	}
+
+	return bfd_read_line(stream, buf, len);
 }
 
 int smtp_server_process(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
 	int disconnect = 0;
-	int hdlr_idx;
+	int slot;
 	int code;
 
 	struct smtp_cmd_hdlr *cmd_hdlr;
+	struct smtp_deferred *d;
 	char *message;
 
 	code = 0;
 	message = NULL;
-	for (hdlr_idx = 0; hdlr_idx < PREPROCESS_HDLRS_LEN; hdlr_idx++) {
-		if (strcasecmp(smtp_cmd_hdlrs[hdlr_idx].cmd_name, cmd))
-			continue;
-
+	if ((slot = smtp_cmd_hash_lookup(&smtp_cmd_hash, cmd)) >= 0) {
 		/* Get the structure with specific handler */
-		cmd_hdlr = &smtp_cmd_hdlrs[hdlr_idx];
+		cmd_hdlr = smtp_cmd_slots[slot];
 
 		/* Call the handler */
 		disconnect = cmd_hdlr->smtp_preprocess_hdlr(ctx, cmd, arg, stream);
 
+		/* The response is sent later by smtp_server_resolve() */
+		if (ctx->code == SMTP_DEFERRED) {
+			ctx->code = 0;
+			return disconnect;
+		}
+
 		if (ctx->code) {
 			code = ctx->code;
 			message = ctx->message;
@@ -110,15 +247,19 @@ int smtp_server_process(struct smtp_server_context *ctx, const char *cmd, const
 			code = 451;
 			message = strdup("Internal server error");
 		}
-
-		break;
-	}
-
-	if (hdlr_idx >= PREPROCESS_HDLRS_LEN) {
+	} else {
 		code = 500;
 		message = strdup("Command not implemented");
 	}
 
+	/* Keep the response after the ones that are still deferred */
+	if (!list_empty(&ctx->deferred) && (d = smtp_server_defer(ctx, NULL, NULL)) != NULL) {
+		ctx->code = 0;
+		d->code = code;
+		d->message = message;
+		return disconnect;
+	}
+
 	smtp_server_response(stream, code, message);
 
 	if (message) {
@@ -144,7 +285,7 @@ int __smtp_server_run(struct smtp_server_context *ctx, bfd_t *stream)
 
 		do {
 			buf[SMTP_COMMAND_MAX] = '\n';
-			if ((sz = bfd_read_line(stream, buf, SMTP_COMMAND_MAX)) < 0) {
+			if ((sz = smtp_server_read_line(ctx, stream, buf, SMTP_COMMAND_MAX)) < 0) {
 				mod_log(LOG_ERR, "Socket read error (%s). Aborting", strerror(errno));
 				return -1;
 			}
@@ -166,7 +307,9 @@ int __smtp_server_run(struct smtp_server_context *ctx, bfd_t *stream)
 
 		/* reject oversized commands */
 		if (n > 1) {
+			smtp_server_resolve(ctx, stream);
 			smtp_server_response(stream, 421, "Command too long");
+			bfd_flush(stream);
 			return -1;
 		}
 
@@ -181,44 +324,24 @@ int __smtp_server_run(struct smtp_server_context *ctx, bfd_t *stream)
 		}
 	} while (!smtp_server_process(ctx, c, c + n, stream));
 
-	return 0;
-}
-
-void smtp_path_init(struct smtp_path *path)
-{
-	memset(path, 0, sizeof(struct smtp_path));
-	INIT_LIST_HEAD(&path->domains);
-	INIT_LIST_HEAD(&path->mailbox.domain.lh);
-}
-
-void smtp_path_cleanup(struct smtp_path *path)
-{
-	struct smtp_domain *pos, *n;
+	/* Send the response to the command that ended the session */
+	smtp_server_resolve(ctx, stream);
+	bfd_flush(stream);
 
-	if (path->mailbox.local != NULL && path->mailbox.local != EMPTY_STRING)
-		free(path->mailbox.local);
-	if (path->mailbox.domain.domain != NULL)
-		free(path->mailbox.domain.domain);
-	list_for_each_entry_safe(pos, n, &path->domains, lh) {
-		free(pos->domain);
-		free(pos);
-	}
-
-	//FIXME ctx->hdrs
+	return 0;
 }
 
 void smtp_server_context_init(struct smtp_server_context *ctx)
 {
-	int i;
-
 	memset(ctx, 0, sizeof(struct smtp_server_context));
+	ctx->rdns_sock = -1;
+	arena_init(&ctx->arena);
 	smtp_path_init(&ctx->rpath);
 	INIT_LIST_HEAD(&ctx->fpath);
 
-	for (i = 0; i < SMTP_PRIV_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&ctx->priv_hash[i]);
-
 	INIT_LIST_HEAD(&ctx->hdrs);
+	INIT_LIST_HEAD(&ctx->body.parts);
+	INIT_LIST_HEAD(&ctx->deferred);
 }
 
 /**
@@ -232,73 +355,397 @@ void smtp_server_context_init(struct smtp_server_context *ctx)
  */
 void smtp_server_context_cleanup(struct smtp_server_context *ctx)
 {
-	struct smtp_path *path, *path_aux;
-	struct im_header *hdr, *hdr_aux;
+	struct mime_part *part, *part_aux;
+	struct smtp_deferred *d;
 
-	smtp_path_cleanup(&ctx->rpath);
-	smtp_path_init(&ctx->rpath);
+	/* the paths of pending responses are released below */
+	list_for_each_entry(d, &ctx->deferred, lh)
+		d->path = NULL;
 
-	list_for_each_entry_safe(path, path_aux, &ctx->fpath, mailbox.domain.lh) {
-		smtp_path_cleanup(path);
-		free(path);
-	}
+	/* scripts must not see the body stream once it is closed */
+	add_body_stream(NULL);
+
+	/* envelope paths and headers are allocated from the arena, so
+	 * they are all released at once */
+	arena_reset(&ctx->arena);
+
+	smtp_path_init(&ctx->rpath);
 	INIT_LIST_HEAD(&ctx->fpath);
+	INIT_LIST_HEAD(&ctx->hdrs);
+	ctx->hdrs_hash = NULL;
+
+	/* scripts must not see the envelope and the headers of this
+	 * transaction any more */
+	js_session_reset(&ctx->rpath, &ctx->fpath);
+
+	if (ctx->hdrs_raw != NULL)
+		free(ctx->hdrs_raw);
+	ctx->hdrs_raw = NULL;
 
-	list_for_each_entry_safe(hdr, hdr_aux, &ctx->hdrs, lh) {
-		im_header_free(hdr);
+	list_for_each_entry_safe(part, part_aux, &ctx->body.parts, lh) {
+		mime_part_free(part);
 	}
-	INIT_LIST_HEAD(&ctx->hdrs);
+	INIT_LIST_HEAD(&ctx->body.parts);
 
 	if (ctx->body.stream != NULL)
 		bfd_close(ctx->body.stream);
 	ctx->body.stream = NULL;
 
-	if (ctx->body.path[0] != '\0')
+	if (ctx->body.path != NULL) {
 		unlink(ctx->body.path);
-	ctx->body.path[0] = '\0';
+		free(ctx->body.path);
+	}
+	ctx->body.path = NULL;
+
+	/* The transaction objects are garbage now; collect them before
+	 * the client sends the next command */
+	js_gc_transaction();
+}
+
+/* Cached once per worker by smtp_server_init() */
+static char hostname[HOST_NAME_MAX + 1];
+
+/* Used to generate queue ids; the process runs a single session */
+static pid_t session_pid;
+static unsigned int session_transactions;
+
+/*
+ * Send a query to all the configured name servers; the first one that
+ * has an answer wins. Returns the number of servers that the query was
+ * sent to.
+ */
+static int smtp_server_rdns_send(int sock, const char *name, int type, unsigned short *id)
+{
+	unsigned char query[PACKETSZ];
+	int len, i, sent = 0;
+
+	if ((len = res_mkquery(QUERY, name, C_IN, type, NULL, 0, NULL, query, sizeof(query))) < 0)
+		return 0;
+
+	/* IPv6 name servers are not in nsaddr_list */
+	for (i = 0; i < _res.nscount; i++) {
+		if (_res.nsaddr_list[i].sin_family != AF_INET)
+			continue;
+		if (sendto(sock, query, len, 0, (struct sockaddr *)&_res.nsaddr_list[i],
+					sizeof(struct sockaddr_in)) == len)
+			sent++;
+	}
+
+	*id = ((HEADER *)query)->id;
+	return sent;
+}
+
+static int smtp_server_rdns_is_ns(struct sockaddr_in *from)
+{
+	int i;
+
+	for (i = 0; i < _res.nscount; i++)
+		if (_res.nsaddr_list[i].sin_addr.s_addr == from->sin_addr.s_addr &&
+				_res.nsaddr_list[i].sin_port == from->sin_port)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Wait until deadline (CLOCK_MONOTONIC, in milliseconds) for the answer
+ * to query id. Answers from other hosts are ignored, and so are failures
+ * of a single server as long as others may still answer. Returns 0 and
+ * sets msg on success.
+ */
+static int smtp_server_rdns_recv(int sock, unsigned short id, int pending, long deadline,
+		unsigned char *answer, size_t size, ns_msg *msg)
+{
+	struct pollfd pfd = {.fd = sock, .events = POLLIN};
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct timespec ts;
+	long timeout;
+	int len;
+
+	while (pending > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		timeout = deadline - (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+		if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0)
+			return -1;
+
+		fromlen = sizeof(from);
+		len = recvfrom(sock, answer, size, 0, (struct sockaddr *)&from, &fromlen);
+		/* a transient error or a truncated datagram, which may well
+		 * be spoofed, must not end the lookup */
+		if (len < (int)sizeof(HEADER))
+			continue;
+		/* not ours (spoofed, or late answer to a previous query) */
+		if (!smtp_server_rdns_is_ns(&from) || ((HEADER *)answer)->id != id)
+			continue;
+		if (ns_initparse(answer, len, msg)) {
+			pending--;
+			continue;
+		}
+		/* a missing name is an answer; try the other servers if this
+		 * one failed */
+		if (ns_msg_getflag(*msg, ns_f_rcode) == ns_r_noerror ||
+				ns_msg_getflag(*msg, ns_f_rcode) == ns_r_nxdomain)
+			return 0;
+		pending--;
+	}
+
+	return -1;
+}
+
+/*
+ * Send the PTR query for the client address. The answer is collected by
+ * smtp_server_rdns_finish() when the name is actually needed, so the
+ * lookup runs in parallel with the SMTP dialogue.
+ */
+static void smtp_server_rdns_start(struct smtp_server_context *ctx)
+{
+	uint32_t addr = ntohl(ctx->addr.sin_addr.s_addr);
+	char name[32];
+	int sock;
+
+	if (!_res.nscount)
+		return;
+
+	snprintf(name, sizeof(name), "%u.%u.%u.%u.in-addr.arpa",
+			addr & 0xff, (addr >> 8) & 0xff, (addr >> 16) & 0xff, addr >> 24);
+
+	if ((sock = socket(PF_INET, SOCK_DGRAM, 0)) == -1)
+		return;
+
+	if ((ctx->rdns_pending = smtp_server_rdns_send(sock, name, T_PTR, &ctx->rdns_id)) == 0) {
+		close(sock);
+		return;
+	}
+
+	ctx->rdns_sock = sock;
+}
+
+/*
+ * Collect the answer to the query sent by smtp_server_rdns_start() and
+ * check that the name maps back to the client address, waiting at most
+ * timeout milliseconds in all. Anybody who controls the reverse zone of
+ * the address can make it point to any name, so an unconfirmed name is
+ * not used. On success, ctx->remote_host is set. Either way, the lookup
+ * is over.
+ */
+static void smtp_server_rdns_finish(struct smtp_server_context *ctx, int timeout)
+{
+	unsigned char answer[PACKETSZ];
+	char name[NS_MAXDNAME];
+	struct timespec ts;
+	unsigned short id;
+	int i, found = 0, pending;
+	long deadline;
+	ns_msg msg;
+	ns_rr rr;
+
+	if (ctx->rdns_sock == -1)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout;
+
+	if (smtp_server_rdns_recv(ctx->rdns_sock, ctx->rdns_id, ctx->rdns_pending, deadline,
+				answer, sizeof(answer), &msg))
+		goto out;
+
+	for (i = 0; !found && i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr))
+			goto out;
+		if (ns_rr_type(rr) != ns_t_ptr)
+			continue;
+		if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr), name, sizeof(name)) < 0)
+			goto out;
+		found = 1;
+	}
+	if (!found)
+		goto out;
+
+	/* forward confirmation */
+	if ((pending = smtp_server_rdns_send(ctx->rdns_sock, name, T_A, &id)) == 0 ||
+			smtp_server_rdns_recv(ctx->rdns_sock, id, pending, deadline,
+				answer, sizeof(answer), &msg))
+		goto out;
+
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		if (ns_parserr(&msg, ns_s_an, i, &rr))
+			break;
+		if (ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4)
+			continue;
+		if (!memcmp(ns_rr_rdata(rr), &ctx->addr.sin_addr.s_addr, 4)) {
+			ctx->remote_host = strdup(name);
+			break;
+		}
+	}
+
+out:
+	close(ctx->rdns_sock);
+	ctx->rdns_sock = -1;
 }
 
 int smtp_server_run(struct smtp_server_context *ctx, bfd_t *stream)
 {
+	struct smtp_module_hook *hook;
+	const struct js_gc_stats *gc;
 	int ret;
 	int hdlr_idx;
 
+	session_pid = getpid();
+	smtp_server_rdns_start(ctx);
+
+	/* bind the script view of the transaction to the context */
+	js_session_reset(&ctx->rpath, &ctx->fpath);
+
 	/* Handle initial greeting */
-	if (smtp_server_process(ctx, "INIT", NULL, stream) || !ctx->code)
-		return 0;
+	if (smtp_server_process(ctx, "INIT", NULL, stream) || !ctx->code) {
+		smtp_server_resolve(ctx, stream);
+		bfd_flush(stream);
+		ret = 0;
+		goto out;
+	}
 
 	ret = __smtp_server_run(ctx, stream);
 
+	/* Drop responses that could not be sent (broken connection) */
+	smtp_server_resolve(ctx, stream);
+
 	/* Give all modules the chance to clean up (possibly after a broken
 	 * connection */
+	for (hook = smtp_clnp_hooks; hook->hdlr != NULL; hook++)
+		hook->hdlr(ctx, "CLNP", NULL, NULL, stream);
 	call_js_handler("CLNP");
 
 	smtp_server_context_cleanup(ctx);
 
+out:
+	gc = js_get_gc_stats();
+	mod_log(LOG_INFO, "JS GC: %u runs, %lu us total, %lu us max pause\n",
+			gc->count, gc->pause, gc->max_pause);
+
+	if (ctx->rdns_sock != -1)
+		close(ctx->rdns_sock);
+	ctx->rdns_sock = -1;
+	free(ctx->remote_host);
+	ctx->remote_host = NULL;
+
 	return ret;
 }
 
-jsval smtp_path_parse_cmd(const char *arg, const char *word)
+/*
+ * Parse the path argument of a MAIL or RCPT command into path. The path
+ * components are copied to the transaction arena. If params is not NULL,
+ * it is set to the ESMTP parameters that follow the path, without the
+ * line ending, or NULL if there are none. Returns 0 on success.
+ */
+int smtp_path_parse_cmd(struct smtp_server_context *ctx, struct smtp_path *path, const char *arg,
+		const char *word, char **params)
 {
-	jsval smtpPath;
+	char *buf, *trailing;
+	size_t n;
 
 	/* Look for passed-in word */
 	arg += strspn(arg, white);
 	if (strncasecmp(arg, word, strlen(word)))
-		return JSVAL_NULL;
+		return 1;
 	arg += strlen(word);
 
 	/* Look for colon */
 	arg += strspn(arg, white);
 	if (*(arg++) != ':')
-		return JSVAL_NULL;
+		return 1;
 
 	/* Parse actual path */
 	arg += strspn(arg, white);
 
-	smtpPath = new_smtp_path_instance(arg);
+	if ((buf = arena_strdup(&ctx->arena, arg)) == NULL)
+		return 1;
+
+	/* ESMTP parameters may follow the path */
+	if (smtp_path_parse(path, buf, &ctx->arena, &trailing))
+		return 1;
+
+	if (params != NULL) {
+		trailing += strspn(trailing, white);
+		for (n = strlen(trailing); n && strchr(white, trailing[n - 1]); n--);
+		trailing[n] = '\0';
+		*params = n ? trailing : NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Look for the SIZE= parameter (RFC 1870) among the ESMTP parameters that
+ * follow the path in a MAIL command. The size is left untouched if the
+ * parameter is missing. Returns -1 if the parameter is malformed.
+ */
+static int smtp_mail_param_size(const char *arg, unsigned long *size)
+{
+	const char *p = strchr(arg, '>');
+	char *end;
+	size_t n;
+
+	if (p == NULL)
+		return 0;
 
-	return smtpPath;
+	for (p++; *(p += strspn(p, white)) != '\0'; p += n) {
+		n = strcspn(p, white);
+		if (n < 5 || strncasecmp(p, "SIZE=", 5))
+			continue;
+		errno = 0;
+		*size = strtoul(p + 5, &end, 10);
+		if (end == p + 5 || end != p + n || errno)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Advertise an ESMTP extension in the EHLO response. Any line with the
+ * same keyword (possibly relayed from the upstream server) is replaced.
+ */
+static int smtp_ehlo_set_ext(struct smtp_server_context *ctx, const char *keyword, const char *param)
+{
+	struct string_buffer sb = STRING_BUFFER_INITIALIZER;
+	size_t len = strlen(keyword);
+	char *line, *next;
+
+	if (ctx->message == NULL)
+		return 0;
+
+	for (line = ctx->message; line != NULL; line = next) {
+		if ((next = strchr(line, '\n')) != NULL)
+			*(next++) = '\0';
+		/* the first line is the greeting, not an extension */
+		if (line != ctx->message && !strncasecmp(line, keyword, len) &&
+				(line[len] == '\0' || line[len] == ' '))
+			continue;
+		if (line != ctx->message && string_buffer_append_char(&sb, '\n'))
+			goto out_err;
+		if (string_buffer_append_string(&sb, line))
+			goto out_err;
+	}
+
+	if (string_buffer_append_char(&sb, '\n'))
+		goto out_err;
+	if (string_buffer_append_string(&sb, keyword))
+		goto out_err;
+	if (param != NULL) {
+		if (string_buffer_append_char(&sb, ' '))
+			goto out_err;
+		if (string_buffer_append_string(&sb, param))
+			goto out_err;
+	}
+
+	free(ctx->message);
+	ctx->message = string_buffer_detach(&sb);
+	return ctx->message != NULL ? 0 : -ENOMEM;
+
+out_err:
+	string_buffer_cleanup(&sb);
+	return -ENOMEM;
 }
 
 int smtp_auth_login_parse_user(struct smtp_server_context *ctx, const char *arg)
@@ -365,10 +812,35 @@ int smtp_auth_unknown_parse(struct smtp_server_context *ctx, const char *arg)
 	return 0;
 }
 
-int smtp_hdlr_init(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+/*
+ * Decide the response to a command: the module hooks and then the
+ * smtpServer.rules decision table answer most commands natively and only
+ * the ones that nothing matched go to the JS handler. arg is the HELO or
+ * EHLO domain, or the ESMTP parameters of the MAIL or RCPT path. Returns
+ * non-zero if the session must end.
+ */
+static int __smtp_server_decide(struct smtp_server_context *ctx, const char *cmd, char *arg,
+		struct smtp_path *path, bfd_t *stream, int slot)
 {
-	// Call the JS handler
-	jsval ret = call_js_handler(cmd);
+	struct smtp_module_hook *hook;
+	int disconnect;
+	jsval ret;
+
+	/* Native policy of the modules comes first */
+	if (slot >= 0) {
+		for (hook = smtp_cmd_hooks[slot]; hook->hdlr != NULL; hook++) {
+			ctx->code = 0;
+			disconnect = hook->hdlr(ctx, cmd, arg, path, stream);
+			if (ctx->code || disconnect)
+				return disconnect;
+		}
+	}
+
+	if (smtp_rules_eval(ctx, cmd, arg, path, &disconnect))
+		return disconnect;
+
+	/* the JS handlers of MAIL and RCPT look at the session envelope */
+	ret = path == NULL && arg != NULL ? call_js_handler_with_arg(cmd, arg) : call_js_handler(cmd);
 
 	// Get code and message returned by JS handler
 	ctx->code = js_get_code(ret);
@@ -377,6 +849,55 @@ int smtp_hdlr_init(struct smtp_server_context *ctx, const char *cmd, const char
 	return js_get_disconnect(ret);
 }
 
+/*
+ * Decide the response to a command and, if it was accepted, give the
+ * SMTP_HOOK_ACCEPTED hooks (e.g. relaying to another server) the chance
+ * to act on it and replace the response.
+ */
+static int smtp_server_decide(struct smtp_server_context *ctx, const char *cmd, char *arg,
+		struct smtp_path *path, bfd_t *stream)
+{
+	struct smtp_module_hook *hook;
+	int disconnect, slot, code;
+	char *message;
+
+	slot = smtp_cmd_hash_lookup(&smtp_cmd_hash, cmd);
+	disconnect = __smtp_server_decide(ctx, cmd, arg, path, stream, slot);
+	if (disconnect || slot < 0 || ctx->code < 200 || ctx->code > 299)
+		return disconnect;
+
+	code = ctx->code;
+	message = ctx->message;
+
+	/* the hooks relay the native headers, so they must include the
+	 * changes that the scripts made to session.headers */
+	if (smtp_cmd_accept_hooks[slot][0].hdlr != NULL && ctx->hdrs_hash != NULL && sync_headers()) {
+		free(message);
+		ctx->code = 451;
+		ctx->message = strdup("Local error in processing");
+		return 0;
+	}
+
+	for (hook = smtp_cmd_accept_hooks[slot]; hook->hdlr != NULL; hook++) {
+		ctx->code = 0;
+		ctx->message = NULL;
+		disconnect = hook->hdlr(ctx, cmd, arg, path, stream);
+		if (ctx->code || disconnect) {
+			free(message);
+			return disconnect;
+		}
+	}
+
+	ctx->code = code;
+	ctx->message = message;
+	return 0;
+}
+
+int smtp_hdlr_init(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
+{
+	return smtp_server_decide(ctx, cmd, NULL, NULL, stream);
+}
+
 int smtp_hdlr_auth(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
 	struct {
@@ -424,7 +945,7 @@ int smtp_hdlr_alou(struct smtp_server_context *ctx, const char *cmd, const char
 
 	assert_mod_log(!ctx->auth_user);
 
-	if ((sz = bfd_read_line(stream, buf, SMTP_COMMAND_MAX)) < 0)
+	if ((sz = smtp_server_read_line(ctx, stream, buf, SMTP_COMMAND_MAX)) < 0)
 		return 0;
 	buf[sz] = '\0';
 
@@ -444,7 +965,7 @@ int smtp_hdlr_alop(struct smtp_server_context *ctx, const char *cmd, const char
 
 	assert_mod_log(!ctx->auth_pw);
 
-	if ((sz = bfd_read_line(stream, buf, SMTP_COMMAND_MAX)) < 0)
+	if ((sz = smtp_server_read_line(ctx, stream, buf, SMTP_COMMAND_MAX)) < 0)
 		return 1;
 	buf[sz] = '\0';
 
@@ -463,7 +984,7 @@ int smtp_hdlr_aplp(struct smtp_server_context *ctx, const char *cmd, const char
 	ssize_t sz;
 
 	if (!ctx->auth_user) {
-		if ((sz = bfd_read_line(stream, buf, SMTP_COMMAND_MAX)) < 0)
+		if ((sz = smtp_server_read_line(ctx, stream, buf, SMTP_COMMAND_MAX)) < 0)
 			return 0;
 		buf[sz] = '\0';
 
@@ -474,19 +995,18 @@ int smtp_hdlr_aplp(struct smtp_server_context *ctx, const char *cmd, const char
 
 int smtp_hdlr_helo(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler_with_arg(cmd, arg);
+	char *domain = (char *)arg;
 
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
+	/* Strip the line ending, as smtp_hdlr_ehlo() does */
+	domain[strcspn(domain, "\r\n")] = '\0';
 
-	return js_get_disconnect(ret);
+	return smtp_server_decide(ctx, cmd, domain, NULL, stream);
 }
 
 int smtp_hdlr_ehlo(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
-	char *domain;
+	char *domain, size[24];
+	int ret;
 
 	/* We must break the rules and modify arg to strip the terminating newline. Otherwise
 	 * the server to which we're proxying gets confused, since it expects the \r\n line
@@ -495,79 +1015,113 @@ int smtp_hdlr_ehlo(struct smtp_server_context *ctx, const char *cmd, const char
 	domain = (char *)arg;
 	domain[strcspn(domain, "\r\n")] = '\0';
 
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler_with_arg(cmd, arg);
-
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
+	ret = smtp_server_decide(ctx, cmd, domain, NULL, stream);
+
+	/* Advertise our own size limit instead of the upstream one; plain
+	 * SIZE means that there is no fixed limit */
+	if (ctx->code == 250) {
+		snprintf(size, sizeof(size), "%lu", ctx->cfg->smtp_max_size);
+		if (smtp_ehlo_set_ext(ctx, "SIZE", ctx->cfg->smtp_max_size ? size : NULL) ||
+				smtp_ehlo_set_ext(ctx, "PIPELINING", NULL)) {
+			mod_log(LOG_ERR, "Could not build the EHLO response\n");
+			free(ctx->message);
+			ctx->code = 451;
+			ctx->message = strdup("Local error in processing");
+		}
+	}
 
-	return js_get_disconnect(ret);
+	return ret;
 }
 
 int smtp_hdlr_mail(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
+	struct smtp_path path;
+	unsigned long size = 0;
+	char *params;
+	int ret;
+
 	if (ctx->rpath.mailbox.local != NULL) {
 		ctx->code = 503;
 		ctx->message = strdup("Sender already specified");
 		return 0;
 	}
 
-	jsval smtpPath = smtp_path_parse_cmd(arg, "FROM");
-
-	if (JSVAL_IS_NULL(smtpPath)) {
+	/* The sender is parsed aside and becomes part of the envelope
+	 * only if the command is accepted */
+	smtp_path_init(&path);
+	if (smtp_path_parse_cmd(ctx, &path, arg, "FROM", &params)) {
 		ctx->code = 501;
 		ctx->message = strdup("Syntax error");
 		return 0;
 	}
 
-	set_envelope_sender(&smtpPath);
+	/* Reject oversized messages before the client starts sending them */
+	if (smtp_mail_param_size(arg, &size)) {
+		ctx->code = 501;
+		ctx->message = strdup("Syntax error in SIZE parameter");
+		return 0;
+	}
 
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler(cmd);
+	if (ctx->cfg->smtp_max_size && size > ctx->cfg->smtp_max_size) {
+		ctx->code = 552;
+		ctx->message = strdup("Message size exceeds fixed maximum message size");
+		return 0;
+	}
 
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
+	set_envelope_sender(&path);
 
-	return js_get_disconnect(ret);
+	ret = smtp_server_decide(ctx, cmd, params, &path, stream);
+
+	if (ctx->code == SMTP_DEFERRED || (ctx->code >= 200 && ctx->code <= 299)) {
+		smtp_path_move(&ctx->rpath, &path);
+		if (ctx->code == SMTP_DEFERRED)
+			smtp_server_defer_path(ctx, &ctx->rpath);
+	}
+	set_envelope_sender(&ctx->rpath);
+
+	return ret;
 }
 
 int smtp_hdlr_rcpt(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
 	struct smtp_path *path;
+	char *params;
+	int ret;
 
-	path = malloc(sizeof(struct smtp_path));
+	path = arena_alloc(&ctx->arena, sizeof(struct smtp_path));
 	if (path == NULL)
 		return 0;
 	smtp_path_init(path);
 
-	jsval smtpPath = smtp_path_parse_cmd(arg, "TO");
-
-	if (JSVAL_IS_NULL(smtpPath)) {
-		free(path);
+	if (smtp_path_parse_cmd(ctx, path, arg, "TO", &params)) {
 		ctx->code = 501;
 		ctx->message = strdup("Syntax error");
 		return 0;
 	}
 
-	add_recipient(&smtpPath);
+	/* Scripts see the recipient while deciding; it is removed again
+	 * if the command is rejected */
 	list_add_tail(&path->mailbox.domain.lh, &ctx->fpath);
+	add_recipient(path);
 
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler(cmd);
+	ret = smtp_server_decide(ctx, cmd, params, path, stream);
 
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
+	if (ctx->code == SMTP_DEFERRED)
+		smtp_server_defer_path(ctx, path);
+	else if (ctx->code < 200 || ctx->code > 299)
+		smtp_server_drop_path(ctx, path);
 
-	return js_get_disconnect(ret);
+	return ret;
 }
 
 int smtp_hdlr_data(struct smtp_server_context *ctx, const char *cmd, const char *arg, bfd_t *stream)
 {
 	int fd;
 
+	/* pipelined recipients may still be rejected by a deferred
+	 * response */
+	smtp_server_resolve(ctx, stream);
+
 	// TODO verificare existenta envelope sender si recipienti; salvare mail in temporar; copiere path temp in smtp_server_context
 	if (list_empty(&ctx->fpath)) {
 		ctx->code = 503;
@@ -576,91 +1130,161 @@ int smtp_hdlr_data(struct smtp_server_context *ctx, const char *cmd, const char
 	}
 
 	/* prepare temporary file to store message body */
-	sprintf(ctx->body.path, "/tmp/mailfilter.XXXXXX"); // FIXME sNprintf; cale in loc de /tmp;
+	if ((ctx->body.path = strdup("/tmp/mailfilter.XXXXXX")) == NULL) // FIXME cale in loc de /tmp;
+		return 0;
 	if ((fd = mkstemp(ctx->body.path)) == -1) {
-		ctx->body.path[0] = '\0';
+		free(ctx->body.path);
+		ctx->body.path = NULL;
 		return 0;
 	}
 
 	if ((ctx->body.stream = bfd_alloc(fd)) == NULL) {
 		close(fd);
 		unlink(ctx->body.path);
-		ctx->body.path[0] = '\0';
+		free(ctx->body.path);
+		ctx->body.path = NULL;
 		return 0;
 	}
 
-	/* prepare response */
+	/* prepare response; this is a synchronization point, so the client
+	 * has seen all pending responses (resolved above) before it sends
+	 * the message */
 	smtp_server_response(stream, 354, "Go ahead");
+	if (bfd_flush(stream) < 0)
+		return 1;
 
 	// Parse the BODY content of DATA
 	struct im_header_context im_hdr_ctx = IM_HEADER_CONTEXT_INITIALIZER;
+	struct mime_context mime = MIME_CONTEXT_INITIALIZER;
 	struct stat stat;
+	int err, ret = 0;
 
 	assert_mod_log(ctx->body.stream != NULL);
 
+	/* the header index is only needed once there are headers */
+	ctx->hdrs_hash = arena_alloc(&ctx->arena, IM_HEADER_HASH_SIZE * sizeof(struct list_head));
+	if (ctx->hdrs_hash != NULL)
+		im_header_hash_init(ctx->hdrs_hash);
+
 	im_hdr_ctx.max_size = 65536; // FIXME use proper value
 	im_hdr_ctx.hdrs = &ctx->hdrs;
+	im_hdr_ctx.hdrs_hash = ctx->hdrs_hash;
+	im_hdr_ctx.arena = &ctx->arena;
 	//sleep(10);
-	switch (smtp_copy_to_file(ctx->body.stream, stream, &im_hdr_ctx)) {
+	mime.parts = &ctx->body.parts;
+	err = smtp_copy_to_file(ctx->body.stream, stream, &im_hdr_ctx, &mime, ctx->cfg->smtp_max_size);
+	mime_context_cleanup(&mime);
+
+	/* Parsed headers point into the raw header block */
+	ctx->hdrs_raw = im_hdr_ctx.raw_block;
+	im_header_context_cleanup(&im_hdr_ctx);
+
+	switch (err) {
 		case 0:
 			break;
+		case -EFBIG:
+			ctx->code = 552;
+			ctx->message = strdup("Message size exceeds fixed maximum message size");
+			goto out;
 		case IM_PARSE_ERROR:
 			ctx->code = 500;
 			ctx->message = strdup("Could not parse message headers");
-			return 0;
+			goto out;
 		case IM_OVERRUN:
 			ctx->code = 552;
 			ctx->message = strdup("Message header size exceeds safety limits");
-			return 0;
+			goto out;
 		default:
 			ctx->code = 452;
 			ctx->message = strdup("Insufficient system storage");
-			return 0;
+			goto out;
 	}
 
 	// Add the file bfd stream to smtpClient.bodyStream
 	if (add_body_stream(ctx->body.stream)) {
-		return 0;
+		goto out;
 	}
 
 	if (bfd_flush(ctx->body.stream) || fstat(ctx->body.stream->fd, &stat) == -1) {
 		ctx->code = 452;
 		ctx->message = strdup("Insufficient system storage");
-		return 0;
+		goto out;
 	}
 	ctx->body.size = stat.st_size;
 
+	/* scripts and relay hooks see the message as we pass it on */
+	if (insert_received_hdr(ctx)) {
+		ctx->code = 452;
+		ctx->message = strdup("Insufficient system storage");
+		goto out;
+	}
+
+	if (set_headers(ctx) || set_mime_parts(&ctx->body.parts)) {
+		ctx->code = 452;
+		ctx->message = strdup("Insufficient system storage");
+		goto out;
+	}
+
 	//printf("path: %s\n", ctx->body.path); sleep(10);
 	//im_header_write(&ctx->hdrs, stdout);
 
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler(cmd);
+	ret = smtp_server_decide(ctx, cmd, NULL, NULL, stream);
 
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
+out:
+	/* The mail transaction is over, whatever its outcome */
+	smtp_server_context_cleanup(ctx);
+	return ret;
+}
 
-	return js_get_disconnect(ret);
+static inline int smtp_spool_putc(bfd_t *out, struct mime_context *mime, int c)
+{
+	if (mime != NULL)
+		mime_feed(mime, c);
+	return bfd_putc(out, c);
 }
 
-int smtp_copy_to_file(bfd_t *out, bfd_t *in, struct im_header_context *im_hdr_ctx)
+/*
+ * Copy the message from the client until the terminating dot line. Headers
+ * are fed to the header parser and everything else goes to the spool file.
+ *
+ * If max_size is non-zero and the client sends more than max_size bytes,
+ * we stop writing to the spool file but keep reading (and discarding) the
+ * data up to the terminating dot line, to stay in sync with the client.
+ * -EFBIG is returned in that case.
+ *
+ * If mime is not NULL, the body is also fed to the MIME structure parser,
+ * which indexes the message parts as they go by.
+ */
+int smtp_copy_to_file(bfd_t *out, bfd_t *in, struct im_header_context *im_hdr_ctx, struct mime_context *mime, unsigned long max_size)
 {
 	const uint64_t DOTLINE_MAGIC	= 0x0d0a2e0000;	/* <CR><LF>"."<*> */
 	const uint64_t DOTLINE_MASK		= 0xffffff0000;
 	const uint64_t CRLF_MAGIC		= 0x0000000d0a; /* <CR><LF> */
 	const uint64_t CRLF_MASK		= 0x000000ffff;
 	uint64_t buf = 0;
-	int fill = 0;
+	unsigned long size = 0;
+	int fill = 0, oversized = 0;
 	int im_state = IM_OK;
+	size_t used;
+	ssize_t sz;
 	int c;
 
+	/* headers are parsed in place, straight from the read buffer */
+	while (im_state == IM_OK && (sz = bfd_fill(in)) > 0) {
+		im_state = im_header_feed_buf(im_hdr_ctx, &in->rb[in->rh], sz, &used);
+		in->rh += used;
+		size += used;
+	}
+	if (max_size && size > max_size)
+		oversized = 1;
+	if (im_state == IM_COMPLETE && mime != NULL && mime_start(mime, im_hdr_ctx->hdrs))
+		mime = NULL;
+
 	while ((c = bfd_getc(in)) >= 0) {
-		if (im_state == IM_OK) {
-			im_state = im_header_feed(im_hdr_ctx, c);
-			continue;
-		}
+		if (max_size && ++size > max_size)
+			oversized = 1;
 		if (++fill > 8) {
-			if (bfd_putc(out, buf >> 56) < 0)
+			if (!oversized && smtp_spool_putc(out, mime, buf >> 56) < 0)
 				return -EIO;
 			fill = 8;
 		}
@@ -678,18 +1302,26 @@ int smtp_copy_to_file(bfd_t *out, bfd_t *in, struct im_header_context *im_hdr_ct
 		/* flush buffer up to the dot; otherwise we get false-positives for
 		 * a line consisting of (only) two dots */
 		assert_log(fill >= 5, &config);
-		while (fill > 3)
-			if (bfd_putc(out, (buf >> (--fill * 8)) & 0xff) < 0)
+		while (fill > 3) {
+			fill--;
+			if (!oversized && smtp_spool_putc(out, mime, (buf >> (fill * 8)) & 0xff) < 0)
 				return -EIO;
+		}
 		buf &= CRLF_MASK;
 		fill = 2;
 	}
 
+	if (oversized)
+		return -EFBIG;
+
 	/* flush remaining buffer */
 	for (fill = (fill - 1) * 8; fill >= 0; fill -= 8)
-		if (bfd_putc(out, (buf >> fill) & 0xff) < 0)
+		if (smtp_spool_putc(out, mime, (buf >> fill) & 0xff) < 0)
 			return -EIO;
 
+	if (mime != NULL)
+		mime_finish(mime);
+
 	return im_state == IM_OK || im_state == IM_COMPLETE ? 0 : im_state;
 }
 
@@ -697,30 +1329,30 @@ static struct im_header *create_received_hdr(struct smtp_server_context *ctx)
 {
 	char *remote_addr = inet_ntoa(ctx->addr.sin_addr);
 	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
-	char ts[32];
-	char remote_host[NI_MAXHOST];
-	char my_hostname[HOST_NAME_MAX];
-	int rev = 0;
-	//char *rcpt;
-	struct im_header *hdr = im_header_alloc("Received");
+	struct tm tm;
+	char ts[32], id[24];
+	struct im_header *hdr = im_header_alloc(&ctx->arena, "Received");
 
 	if (hdr == NULL)
 		return NULL;
 
-	if (!getnameinfo((struct sockaddr *)&ctx->addr, sizeof(ctx->addr), remote_host, sizeof(remote_host), NULL, 0, 0))
-		rev = strcmp(remote_host, remote_addr);
-	gethostname(my_hostname, sizeof(my_hostname));
-	strftime(ts, sizeof(ts), "%a, %d %b %Y %H:%M:%S %z", tm);
-	//rcpt = smtp_path_to_string(list_entry(ctx->fpath.prev, struct smtp_path, mailbox.domain.lh));
-	asprintf(&hdr->value,
+	/* normally the answer arrived long ago, while the client was
+	 * busy sending the envelope and the message */
+	smtp_server_rdns_finish(ctx, SMTP_RDNS_TIMEOUT);
+
+	/* the time zone was loaded once by smtp_server_init() */
+	localtime_r(&t, &tm);
+	strftime(ts, sizeof(ts), "%a, %d %b %Y %H:%M:%S %z", &tm);
+	snprintf(id, sizeof(id), "%08lX%06X%04X", (unsigned long)t,
+			(unsigned int)session_pid & 0xffffff, session_transactions++ & 0xffff);
+
+	hdr->value = arena_printf(&ctx->arena,
 			"from %s (%s%s[%s]) by %s (8.14.2/8.14.2) with SMTP id %s; %s",
-			ctx->identity ? ctx->identity: (rev ? remote_host : remote_addr),
-			rev ? remote_host : "", rev ? " " : "",
-			remote_addr, my_hostname, "abcdef123456", ts);
-	//free(rcpt);
+			ctx->identity ? ctx->identity : (ctx->remote_host ? ctx->remote_host : remote_addr),
+			ctx->remote_host ? ctx->remote_host : "", ctx->remote_host ? " " : "",
+			remote_addr, hostname, id, ts);
 
-	return hdr;
+	return hdr->value != NULL ? hdr : NULL;
 }
 
 /*
@@ -739,7 +1371,7 @@ int insert_received_hdr(struct smtp_server_context *ctx)
 		return -ENOMEM;
 
 	im_header_refold(hdr, 78);
-	list_add_tail(&hdr->lh, lh);
+	im_header_insert(&ctx->hdrs, ctx->hdrs_hash, hdr, lh);
 	return 0;
 }
 
@@ -755,63 +1387,152 @@ int smtp_hdlr_rset(struct smtp_server_context *ctx, const char *cmd, const char
 {
 	smtp_server_context_cleanup(ctx);
 
-	// If no error until now, call the JS handler
-	jsval ret = call_js_handler(cmd);
-
-	// Get code and message returned by JS handler
-	ctx->code = js_get_code(ret);
-	ctx->message = js_get_message(ret);
-
-	return js_get_disconnect(ret);
+	return smtp_server_decide(ctx, cmd, NULL, NULL, stream);
 }
 
-void smtp_server_init(void)
+static LIST_HEAD(smtp_modules);
+static int smtp_module_count;
+
+/*
+ * Number of hooks for the command of hook that run at the same stage
+ * before it: the ones of the registered modules and the ones that come
+ * first in mod. Each command has room for SMTP_MODULE_MAX hooks of each
+ * stage.
+ */
+static int smtp_module_hook_count(struct smtp_module *mod, const struct smtp_module_hook *hook)
 {
-	// TODO urmatoarele trebuie sa se intample din config
-	mod_proxy_init();
-	//mod_spamassassin_init();
-	//mod_clamav_init();
-	//mod_log_sql_init();
+	const struct smtp_module_hook *h;
+	struct smtp_module *m;
+	int count = 0;
+
+	list_for_each_entry(m, &smtp_modules, lh)
+		for (h = m->hooks; h != NULL && h->cmd != NULL; h++)
+			count += !strcasecmp(h->cmd, hook->cmd) && h->flags == hook->flags;
+
+	for (h = mod->hooks; h != hook; h++)
+		count += !strcasecmp(h->cmd, hook->cmd) && h->flags == hook->flags;
+
+	return count;
 }
 
-int smtp_priv_register(struct smtp_server_context *ctx, uint64_t key, void *priv)
+/*
+ * Called by the SMTP_MODULE() constructors, before main(), and by
+ * smtp_module_load()
+ */
+int smtp_module_register(struct smtp_module *mod)
 {
-	struct smtp_priv_hash *h;
+	const struct smtp_module_hook *hook;
 
-	h = malloc(sizeof(struct smtp_priv_hash));
-	if (h == NULL)
-		return -ENOMEM;
+	if (mod->abi != SMTP_MODULE_ABI) {
+		fprintf(stderr, "Module %s was built for ABI version %d instead of %d.\n",
+				mod->name, mod->abi, SMTP_MODULE_ABI);
+		return -1;
+	}
 
-	h->key = key;
-	h->priv = priv;
-	list_add_tail(&h->lh, &ctx->priv_hash[smtp_priv_bucket(key)]);
+	if (smtp_module_count >= SMTP_MODULE_MAX) {
+		fprintf(stderr, "Too many modules; could not register %s.\n", mod->name);
+		return -1;
+	}
+
+	for (hook = mod->hooks; hook != NULL && hook->cmd != NULL; hook++) {
+		if (smtp_module_hook_count(mod, hook) >= SMTP_MODULE_MAX) {
+			fprintf(stderr, "Too many hooks for %s; could not register %s.\n",
+					hook->cmd, mod->name);
+			return -1;
+		}
+	}
 
+	mod->slot = smtp_module_count++;
+	list_add_tail(&mod->lh, &smtp_modules);
 	return 0;
 }
 
-void *smtp_priv_lookup(struct smtp_server_context *ctx, uint64_t key)
+/*
+ * Load a shared object module and register it. Must be called before
+ * smtp_server_init(). Loading a module again returns the same descriptor.
+ */
+struct smtp_module *smtp_module_load(const char *path)
 {
-	struct smtp_priv_hash *h;
-	int i = smtp_priv_bucket(key);
+	struct smtp_module **info;
+	void *handle;
 
-	list_for_each_entry(h, &ctx->priv_hash[i], lh)
-		if (h->key == key)
-			return h->priv;
+	if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		fprintf(stderr, "Could not load module %s: %s\n", path, dlerror());
+		return NULL;
+	}
+
+	if ((info = dlsym(handle, "smtp_module_info")) == NULL || *info == NULL) {
+		fprintf(stderr, "%s is not a mailfilter module.\n", path);
+		goto out_err;
+	}
 
+	/* Already loaded */
+	if ((*info)->abi == SMTP_MODULE_ABI && (*info)->slot >= 0)
+		return *info;
+
+	if (smtp_module_register(*info))
+		goto out_err;
+
+	/* The module code stays mapped for the lifetime of the process */
+	return *info;
+
+out_err:
+	dlclose(handle);
 	return NULL;
 }
 
-int smtp_priv_unregister(struct smtp_server_context *ctx, uint64_t key)
+void smtp_server_init(void)
 {
-	struct smtp_priv_hash *h;
-	int i = smtp_priv_bucket(key);
+	const char *cmds[PREPROCESS_HDLRS_LEN];
+	const struct smtp_module_hook *hook;
+	struct smtp_module_hook *hooks;
+	struct smtp_module *mod;
+	int i, slot;
+
+	for (i = 0; i < PREPROCESS_HDLRS_LEN; i++)
+		cmds[i] = smtp_cmd_hdlrs[i].cmd_name;
+	if (smtp_cmd_hash_init(&smtp_cmd_hash, cmds, PREPROCESS_HDLRS_LEN)) {
+		fprintf(stderr, "Could not index the SMTP command handlers.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < PREPROCESS_HDLRS_LEN; i++)
+		smtp_cmd_slots[smtp_cmd_hash_lookup(&smtp_cmd_hash, cmds[i])] = &smtp_cmd_hdlrs[i];
+
+	/* Per-message data that does not change during the lifetime of
+	 * the workers, which inherit it */
+	if (gethostname(hostname, sizeof(hostname) - 1))
+		strcpy(hostname, "localhost");
+	tzset();
+	res_init();
+
+	/* The workers share the cache, so it must exist before they fork */
+	if (shm_cache_init(config.cache_entries)) {
+		fprintf(stderr, "Could not create the shared cache.\n");
+		exit(EXIT_FAILURE);
+	}
 
-	list_for_each_entry(h, &ctx->priv_hash[i], lh)
-		if (h->key == key) {
-			list_del(&h->lh);
-			free(h);
-			return 0;
+	list_for_each_entry(mod, &smtp_modules, lh) {
+		for (hook = mod->hooks; hook != NULL && hook->cmd != NULL; hook++) {
+			if (!strcasecmp(hook->cmd, "CLNP"))
+				hooks = smtp_clnp_hooks;
+			else if ((slot = smtp_cmd_hash_lookup(&smtp_cmd_hash, hook->cmd)) < 0) {
+				fprintf(stderr, "Module %s hooks unknown command %s.\n",
+						mod->name, hook->cmd);
+				exit(EXIT_FAILURE);
+			} else if (hook->flags & SMTP_HOOK_ACCEPTED)
+				hooks = smtp_cmd_accept_hooks[slot];
+			else
+				hooks = smtp_cmd_hooks[slot];
+			/* smtp_module_register() already refused modules
+			 * that would not fit */
+			for (i = 0; hooks[i].hdlr != NULL; i++);
+			if (i >= SMTP_MODULE_MAX) {
+				fprintf(stderr, "Too many hooks for %s.\n", hook->cmd);
+				exit(EXIT_FAILURE);
+			}
+			hooks[i] = *hook;
 		}
-
-	return -ESRCH;
+		if (mod->init != NULL)
+			mod->init();
+	}
 }
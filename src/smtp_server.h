@@ -33,6 +33,7 @@
 #include "smtp.h"
 #include "logging.h"
 #include "internet_message.h"
+#include "mime.h"
 #include "bfd.h"
 
 /**
@@ -40,6 +41,19 @@
  */
 #define	PREPROCESS_HDLRS_LEN	12
 
+/*
+ * Time (in milliseconds) that a session waits for the client before it
+ * is considered idle and releases its buffers
+ */
+#define SMTP_IDLE_TIMEOUT 1000
+
+/*
+ * Time (in milliseconds) that the "Received" header waits for the reverse
+ * lookup of the client address and its forward confirmation, if they
+ * have not completed yet
+ */
+#define SMTP_RDNS_TIMEOUT 2000
+
 struct smtp_server_context;
 
 /**
@@ -89,14 +103,140 @@ struct smtp_cmd_hdlr {
 #define DEFINE_SMTP_CMD_HDLR(name) \
 	{ #name , &smtp_hdlr_##name } \
 
-#define SMTP_PRIV_HASH_SIZE 16
+/**
+ * Response code set by a handler that called smtp_server_defer(). The
+ * actual response is provided later by the resolve callback.
+ */
+#define SMTP_DEFERRED -2
 
-struct smtp_priv_hash {
-	uint64_t key;
+struct smtp_deferred;
+
+/**
+ * Callback that provides the response to a deferred command, by setting
+ * the code and message fields. Returns non-zero on error.
+ */
+typedef int (*smtp_resolve_t)(struct smtp_server_context *ctx, struct smtp_deferred *d);
+
+/**
+ * Response to a command that is sent to the client later. This allows
+ * modules to pipeline commands to an upstream server (RFC 2920).
+ */
+struct smtp_deferred {
+	struct list_head lh;
+	int code;
+	char *message;
+	smtp_resolve_t resolve;
 	void *priv;
+	/* Envelope path that is dropped if the command is rejected */
+	struct smtp_path *path;
+};
+
+/**
+ * Maximum number of modules; this is also the size of the per-session
+ * private data table.
+ */
+#define SMTP_MODULE_MAX 16
+
+/**
+ * Version of the module interface. Shared object modules built against a
+ * different version are refused by smtp_module_load(); bump it whenever
+ * struct smtp_module, struct smtp_server_context or the handler
+ * prototypes change.
+ */
+#define SMTP_MODULE_ABI 2
+
+/**
+ * Directory where engine.loadModule() looks up modules given by name
+ */
+#ifndef SMTP_MODULE_DIR
+#define SMTP_MODULE_DIR "/usr/local/lib/mailfilter"
+#endif
+
+/**
+ * Per-command hook of a module. Hooks run, in the order the modules were
+ * registered, after the command was parsed and before smtpServer.rules
+ * and the JS handler. A hook that sets ctx->code (or returns non-zero to
+ * disconnect) decides the command; the ones that follow are skipped.
+ * Hooks are called for INIT, HELO, EHLO, MAIL, RCPT, DATA and RSET. arg
+ * is the HELO/EHLO domain or the ESMTP parameters of MAIL/RCPT, without
+ * the line ending, and NULL otherwise. path is the MAIL or RCPT path
+ * being decided, and NULL otherwise; it becomes part of the envelope only
+ * if the command is accepted.
+ *
+ * Hooks flagged SMTP_HOOK_ACCEPTED run instead after the command was
+ * accepted (2xx) by the other hooks, smtpServer.rules or the JS handler,
+ * with ctx->code cleared; setting it replaces the local response. The
+ * "CLNP" pseudo-command hooks run once, at the end of the session, even
+ * after a broken connection; cmd and stream are the only valid arguments.
+ */
+typedef int (*smtp_hook_t)(struct smtp_server_context *ctx, const char *cmd, const char *arg,
+		struct smtp_path *path, bfd_t *stream);
+
+#define SMTP_HOOK_ACCEPTED	0x01
+
+struct smtp_module_hook {
+	const char *cmd;
+	smtp_hook_t hdlr;
+	int flags;
+};
+
+struct JSContext;
+struct JSObject;
+
+/**
+ * Module descriptor. Modules declare themselves with SMTP_MODULE() and
+ * are initialized by smtp_server_init().
+ */
+struct smtp_module {
+	/* SMTP_MODULE_ABI the module was built against; must come first */
+	int abi;
+	const char *name;
+	/* Called once, at startup; may be NULL */
+	void (*init)(void);
+	/* Command hooks, terminated by a NULL cmd; may be NULL */
+	const struct smtp_module_hook *hooks;
+	/* Defines the JS bindings of the module in the global object. Called
+	 * by engine.loadModule(); may be NULL. Returns non-zero on error. */
+	int (*js_init)(struct JSContext *cx, struct JSObject *global);
+	/* Index in smtp_server_context.priv, assigned on registration */
+	int slot;
 	struct list_head lh;
 };
 
+extern int smtp_module_register(struct smtp_module *mod);
+extern struct smtp_module *smtp_module_load(const char *path);
+
+/*
+ * Modules are either linked in, and register themselves before main(),
+ * or built as shared objects (with -DSMTP_MODULE_DSO) and registered by
+ * smtp_module_load(), which looks up the smtp_module_info symbol.
+ */
+#ifdef SMTP_MODULE_DSO
+#define __SMTP_MODULE_REGISTER(__mod) \
+	struct smtp_module *smtp_module_info = &__mod;
+#else
+#define __SMTP_MODULE_REGISTER(__mod) \
+	static void __attribute__((constructor)) __mod##_register(void) \
+	{ \
+		if (smtp_module_register(&__mod)) \
+			exit(EXIT_FAILURE); \
+	}
+#endif
+
+#define SMTP_MODULE_EXT(__mod, __name, __init, __hooks, __js_init) \
+	static struct smtp_module __mod = { \
+		.abi = SMTP_MODULE_ABI, \
+		.name = __name, \
+		.init = __init, \
+		.hooks = __hooks, \
+		.js_init = __js_init, \
+		.slot = -1 \
+	}; \
+	__SMTP_MODULE_REGISTER(__mod)
+
+#define SMTP_MODULE(__mod, __name, __init) \
+	SMTP_MODULE_EXT(__mod, __name, __init, NULL, NULL)
+
 /**
  * SMTP server context.
  */
@@ -107,6 +247,18 @@ struct smtp_server_context {
 	/* Remote end address */
 	struct sockaddr_in addr;
 
+	/* Remote end name, as found by the reverse lookup of addr and
+	 * confirmed by the forward lookup of the name. NULL if either lookup
+	 * failed or has not completed yet. */
+	char *remote_host;
+
+	/* Socket, query id and number of name servers that have not
+	 * answered yet, of the reverse lookup in flight; the socket is -1 if
+	 * there is none */
+	int rdns_sock;
+	unsigned short rdns_id;
+	int rdns_pending;
+
 	/* Command tree node that is currently being run */
 	struct smtp_cmd_tree *node;
 
@@ -127,16 +279,29 @@ struct smtp_server_context {
 
 	struct list_head hdrs;
 
+	/* Hash index of hdrs, by header name (see im_header_find()).
+	 * IM_HEADER_HASH_SIZE buckets allocated from the arena once
+	 * "DATA" is issued; NULL before that. */
+	struct list_head *hdrs_hash;
+
+	/* Header block as received from the client; parsed headers point
+	 * into it (see struct im_header) */
+	char *hdrs_raw;
+
 	/* Message body */
 	struct {
-		/* Path to tmp file or empty string if "DATA" was not issued */
-		char path[PATH_MAX];
+		/* Path to tmp file or NULL if "DATA" was not issued */
+		char *path;
 
 		/* Stream of tmp file or NULL if "DATA" was not issued */
 		bfd_t *stream;
 
 		/* Size of message body (without headers) */
 		off_t size;
+
+		/* MIME structure of the body (list of struct mime_part);
+		 * offsets are relative to the tmp file */
+		struct list_head parts;
 	} body;
 
 	/* SMTP status code to send back to client */
@@ -145,42 +310,39 @@ struct smtp_server_context {
 	/* SMTP message to send back to client */
 	char *message, *prev_message;
 
-	/* Hash of per-module private data */
-	struct list_head priv_hash[SMTP_PRIV_HASH_SIZE];
+	/* Responses that are not sent yet, in command order */
+	struct list_head deferred;
+
+	/* Allocations that live as long as the transaction: envelope
+	 * paths and message headers */
+	struct arena arena;
+
+	/* Per-module private data, indexed by smtp_module.slot */
+	void *priv[SMTP_MODULE_MAX];
 };
 
 extern int smtp_cmd_register(const char *cmd, smtp_cmd_hdlr_t hdlr, int prio, int invokable);
 extern void smtp_server_init(void);
 extern int smtp_server_run(struct smtp_server_context *ctx, bfd_t *stream);
+extern struct smtp_deferred *smtp_server_defer(struct smtp_server_context *ctx, smtp_resolve_t resolve, void *priv);
+extern int smtp_server_resolve(struct smtp_server_context *ctx, bfd_t *stream);
+extern int smtp_copy_to_file(bfd_t *out, bfd_t *in, struct im_header_context *im_hdr_ctx, struct mime_context *mime, unsigned long max_size);
+extern int insert_received_hdr(struct smtp_server_context *ctx);
 extern void smtp_server_context_init(struct smtp_server_context *ctx);
-extern int smtp_priv_register(struct smtp_server_context *ctx, uint64_t key, void *priv);
-extern void *smtp_priv_lookup(struct smtp_server_context *ctx, uint64_t key);
-extern int smtp_priv_unregister(struct smtp_server_context *ctx, uint64_t key);
-
-static inline int smtp_priv_bucket(uint64_t key)
+extern size_t smtp_server_footprint(struct smtp_server_context *ctx);
+static inline void smtp_priv_register(struct smtp_server_context *ctx, struct smtp_module *mod, void *priv)
 {
-	int i, ret = 0;
-
-	for (i = 0; i < 8; i++) {
-		ret += key & 0xff;
-		key >>= 8;
-	}
-
-	return ret % SMTP_PRIV_HASH_SIZE;
+	ctx->priv[mod->slot] = priv;
 }
 
-static inline uint64_t smtp_priv_key(const char *str)
+static inline void *smtp_priv_lookup(struct smtp_server_context *ctx, struct smtp_module *mod)
 {
-	uint64_t ret = 0;
-	int i = 0;
-
-	while (*str != '\0') {
-		if (++i > 8)
-			return ret;
-		ret = (ret << 8) | *(unsigned char *)(str++);
-	}
+	return ctx->priv[mod->slot];
+}
 
-	return ret;
+static inline void smtp_priv_unregister(struct smtp_server_context *ctx, struct smtp_module *mod)
+{
+	ctx->priv[mod->slot] = NULL;
 }
 
 #endif
@@ -25,20 +25,55 @@
 
 #include "string_tools.h"
 
-int __string_buffer_enlarge(struct string_buffer *sb, size_t chunk)
+int __string_buffer_reserve(struct string_buffer *sb, size_t len)
 {
-	void *s = realloc(sb->s, sb->size + chunk);
+	size_t size = sb->s == NULL || sb->s == sb->inl ? sb->chunk : sb->size;
+	char *s;
 
-	if (s == NULL)
-		return ENOMEM;
+	if (!size)
+		size = STRING_BUFFER_CHUNK;
+
+	if (sb->s == NULL && len < STRING_BUFFER_INLINE) {
+		sb->s = sb->inl;
+		sb->s[0] = '\0';
+		sb->size = STRING_BUFFER_INLINE;
+		return 0;
+	}
+
+	while (size < sb->cur + len + 1)
+		size *= 2;
+
+	if (sb->s == sb->inl) {
+		if ((s = malloc(size)) == NULL)
+			return ENOMEM;
+		memcpy(s, sb->inl, sb->cur + 1);
+	} else {
+		if ((s = realloc(sb->s, size)) == NULL)
+			return ENOMEM;
+		if (sb->s == NULL)
+			s[0] = '\0';
+	}
 
-	memset(s + sb->size, 0, chunk);
 	sb->s = s;
-	sb->size += chunk;
+	sb->size = size;
 
 	return 0;
 }
 
+char *string_buffer_detach(struct string_buffer *sb)
+{
+	char *s = sb->s;
+
+	if (s == sb->inl)
+		s = strdup(sb->inl);
+	else if (s != NULL && sb->cur + 1 < sb->size / 2)
+		s = realloc(s, sb->cur + 1) ?: s;
+
+	__string_buffer_init(sb, sb->chunk);
+
+	return s;
+}
+
 int expr_expand(const char *expr, struct string_buffer *sb, const char *keys, expr_expand_callback_t cbk, void *priv, size_t *offset)
 {
 	enum {
@@ -30,12 +30,19 @@
 /* A few basic rules about string buffers:
  *   - sb->s is NULL after string_buffer_init() and is initialized
  *     after the first append operation;
- *   - sb->s can be explicitly initialized using string_buffer_enlarge()
+ *   - short strings are held in sb->inl and only longer ones are moved
+ *     to the heap, so sb->s must not be kept once the buffer goes away
+ *     or is moved; use string_buffer_detach() to take ownership of it
  *   - if sb->s is not NULL, then it points to a null-terminated string
+ *     of sb->cur characters
+ *   - the heap storage grows geometrically, starting at sb->chunk bytes
  */
+#define STRING_BUFFER_INLINE 32
+
 struct string_buffer {
 	char *s;
 	size_t size, cur, chunk;
+	char inl[STRING_BUFFER_INLINE];
 };
 
 #define STRING_BUFFER_CHUNK 256
@@ -51,61 +58,83 @@ struct string_buffer {
 
 static inline void __string_buffer_init(struct string_buffer *sb, size_t chunk)
 {
-	memset(sb, 0, sizeof(struct string_buffer));
+	sb->s = NULL;
+	sb->size = 0;
+	sb->cur = 0;
 	sb->chunk = chunk;
 }
 
 static inline void string_buffer_cleanup(struct string_buffer *sb)
 {
-	if (sb->s != NULL)
+	if (sb->s != NULL && sb->s != sb->inl)
 		free(sb->s);
 	sb->s = NULL;
+	sb->size = 0;
+	sb->cur = 0;
 }
 
 #define __STRING_BUFFER_INIT(__sb, __chunk...) __string_buffer_init(__sb, __chunk)
 #define string_buffer_init(__sb, __chunk...) __STRING_BUFFER_INIT(__sb, ##__chunk, STRING_BUFFER_CHUNK)
 
-int __string_buffer_enlarge(struct string_buffer *sb, size_t chunk);
-#define string_buffer_enlarge(sb) __string_buffer_enlarge((sb), (sb)->chunk)
+/*
+ * Make room for at least len more characters (plus the terminator).
+ * Slow path of the append functions; use string_buffer_reserve().
+ */
+int __string_buffer_reserve(struct string_buffer *sb, size_t len);
+
+static inline int string_buffer_reserve(struct string_buffer *sb, size_t len)
+{
+	/* we add 1 to keep an extra byte for the null terminator */
+	if (sb->cur + len + 1 > sb->size)
+		return __string_buffer_reserve(sb, len);
+	return 0;
+}
+
+/*
+ * Hand the string over to the caller, who must free() it. The buffer
+ * is left empty. Returns NULL if nothing was appended or on ENOMEM.
+ */
+char *string_buffer_detach(struct string_buffer *sb);
 
 static inline void string_buffer_reset(struct string_buffer *sb)
 {
 	sb->cur = 0;
 	if (sb->s)
-		memset(sb->s, 0, sb->size);
-	/* reset to 0 the whole memory area, since string_buffer_append_char()
-	 * expects the memory to be already zeroed */
+		sb->s[0] = '\0';
 }
 
 static inline int string_buffer_append_char(struct string_buffer *sb, char c)
 {
 	int err;
 
-	/* we add 1 to keep an extra byte for the null terminator */
-	if (sb->cur + 1 >= sb->size && (err = string_buffer_enlarge(sb)))
+	if ((err = string_buffer_reserve(sb, 1)))
 		return err;
 
 	sb->s[sb->cur++] = c;
-	/* we don't need to add a '\0' because string_buffer_enlarge()
-	 * zeroes the newly allocated memory for us */
+	sb->s[sb->cur] = '\0';
 
 	return 0;
 }
 
-static inline int string_buffer_append_string(struct string_buffer *sb, const char *s)
+static inline int string_buffer_append_strn(struct string_buffer *sb, const char *s, size_t len)
 {
-	size_t len = strlen(s);
 	int err;
 
-	if (sb->cur + len >= sb->size && (err = __string_buffer_enlarge(sb, sb->chunk * ((sb->chunk + sb->cur + len - sb->size) / sb->chunk))))
+	if ((err = string_buffer_reserve(sb, len)))
 		return err;
 
-	strcpy(sb->s + sb->cur, s);
+	memcpy(sb->s + sb->cur, s, len);
 	sb->cur += len;
+	sb->s[sb->cur] = '\0';
 
 	return 0;
 }
 
+static inline int string_buffer_append_string(struct string_buffer *sb, const char *s)
+{
+	return string_buffer_append_strn(sb, s, strlen(s));
+}
+
 /* ------------------ Generic expression expansion ---------------- */
 
 typedef int (*expr_expand_callback_t)(struct string_buffer *sb, char key, const char *token, size_t tklen, void *priv);